@@ -0,0 +1,108 @@
+/*!
+ * @namespace msg::capture
+ * Capture files: the messages received by chosen agents (see
+ * msg::setCapture), each as a TRecordHeader and then the message as it came
+ * out of the queue, for messaging_capture to replay.
+ *
+ * Files are opened for appending and each record is written with a single
+ * writev, so several processes may capture into the same file without their
+ * records getting mixed up.
+ */
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "capture.hpp"
+#include "log.hpp"
+
+namespace msg
+   {
+   namespace capture
+      {
+      /*!
+       * @return A descriptor to record to, or -1 on failure.
+       */
+         int
+      open
+         (
+         Tnc8 *path
+         )
+         {
+         int fd = ::open(path, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP);
+         if(-1 == fd)
+            {
+            MESSAGING_LOG_ERROR("Cannot open \"%s\"", path);
+            MESSAGING_LOG_POSIX_ERROR;
+            }
+         return fd;
+         }
+
+         Ts32
+      record
+         (
+         int fd,
+         const TVoid *message,
+         size_t length
+         )
+         {
+         struct timespec now;
+         clock_gettime(CLOCK_REALTIME, &now);
+         TRecordHeader header;
+         header.timeUs = (Ts64)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+         header.length = length;
+         header.reserved = 0;
+
+         struct iovec iov[2];
+         iov[0].iov_base = &header;
+         iov[0].iov_len = sizeof(header);
+         iov[1].iov_base = (TVoid *)message;
+         iov[1].iov_len = length;
+         if((ssize_t)(sizeof(header) + length) != ::writev(fd, iov, 2))
+            {
+            MESSAGING_LOG_POSIX_ERROR;
+            return FAILURE;
+            }
+         return SUCCESS;
+         }
+
+      /*!
+       * Hand every record in the file at path to handler, in order, until it
+       * returns FALSE.
+       * @return The number of records handled, or -1 if the file cannot be
+       * read.
+       */
+         ssize_t
+      replay
+         (
+         Tnc8 *path,
+         TRecordHandler handler,
+         TVoid *context
+         )
+         {
+         FILE *fp = fopen(path, "rb");
+         if(!fp)
+            {
+            MESSAGING_LOG_ERROR("Cannot open \"%s\"", path);
+            return -1;
+            }
+         ssize_t count = 0;
+         TRecordHeader header;
+         Tn8 message[16*1024];
+         while(fread(&header, sizeof(header), 1, fp) == 1)
+            {
+            if(header.length > sizeof(message) || fread(message, header.length, 1, fp) != 1)
+               {
+               MESSAGING_LOG_ERROR("Record %ld of \"%s\" is truncated or corrupt", (long)count, path);
+               break;
+               }
+            count++;
+            if(!handler(&header, message, context))
+               break;
+            }
+         fclose(fp);
+         return count;
+         }
+      }
+   }
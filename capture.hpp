@@ -0,0 +1,36 @@
+/*
+ * capture.hpp
+ *
+ *  Created on: Oct 19, 2026
+ */
+
+#ifndef CAPTURE_HPP_
+#define CAPTURE_HPP_
+
+#include "include/aditypes.h"
+
+namespace msg
+   {
+   namespace capture
+      {
+      /*!
+       * Precedes every message in a capture file.
+       */
+      typedef struct
+         {
+         Ts64 timeUs; // CLOCK_REALTIME, when the message was received
+         Tu32 length; // of the message that follows, header and body
+         Tu32 reserved;
+         } TRecordHeader;
+
+      typedef TBoolean (*TRecordHandler)(const TRecordHeader *, const TVoid *message, TVoid *context);
+
+      int open(Tnc8 *path);
+
+      Ts32 record(int fd, const TVoid *message, size_t length);
+
+      ssize_t replay(Tnc8 *path, TRecordHandler, TVoid *context);
+      }
+   }
+
+#endif /* CAPTURE_HPP_ */
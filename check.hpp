@@ -0,0 +1,50 @@
+/*
+ * check.hpp
+ *
+ *  Created on: Oct 19, 2026
+ *
+ * What the tests run by "make check" have in common: CHECK counts and
+ * reports a failed condition without stopping the test, and checkResult
+ * gives main its exit status.
+ */
+
+#ifndef CHECK_HPP_
+#define CHECK_HPP_
+
+#include <cstdio>
+
+#include "include/aditypes.h"
+
+static size_t g_failures = 0;
+
+#define CHECK(condition, ...) \
+   do \
+      { \
+      if(!(condition)) \
+         { \
+         printf("FAILED: " __VA_ARGS__); \
+         printf("\n"); \
+         g_failures++; \
+         } \
+      } while(0)
+
+/*!
+ * @param what What was tested, for the line saying it passed.
+ * @return The exit status for main.
+ */
+   static int
+checkResult
+   (
+   Tnc8 *what
+   )
+   {
+   if(g_failures)
+      {
+      printf("%u checks failed\n", (unsigned)g_failures);
+      return 1;
+      }
+   printf("%s tests passed\n", what);
+   return 0;
+   }
+
+#endif /* CHECK_HPP_ */
@@ -0,0 +1,372 @@
+/*!
+ * @namespace msg::journal
+ * Append-only, memory-mapped record of the messages sent to an agent, kept
+ * so that they survive a restart of either end or of the box (see
+ * msg::setPersistent).
+ *
+ * A journal is a "head" file holding the shared state (THead) and a series
+ * of fixed-size segment files holding the records. Segments are rotated when
+ * full and deleted once every record in them has been acknowledged. Records
+ * are synced to disk in groups of JOURNAL_GROUP_COMMIT rather than one at a
+ * time, or sooner by commit (msg::setPersistent does so on a timer). Every
+ * process that opens the same journal takes the head's lock before touching
+ * it, so several producers may append to one journal.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "journal.hpp"
+#include "log.hpp"
+
+#define JOURNAL_SEGMENT_SIZE (4*1024*1024)
+#define JOURNAL_GROUP_COMMIT 32
+
+namespace msg
+   {
+   namespace journal
+      {
+         static std::string
+      segmentPath
+         (
+         TJournal *j,
+         size_t segment
+         )
+         {
+         Tn8 suffix[16];
+         snprintf(suffix, sizeof(suffix), ".%08lu", (unsigned long)segment);
+         return j->base + suffix;
+         }
+
+         static Tn8 *
+      mapSegment
+         (
+         TJournal *j,
+         size_t segment,
+         TBoolean create
+         )
+         {
+         std::string path = segmentPath(j, segment);
+         int fd = ::open(path.c_str(), O_RDWR | (create ? O_CREAT : 0), S_IRUSR | S_IWUSR);
+         if(-1 == fd)
+            {
+            if(create)
+               MESSAGING_LOG_POSIX_ERROR;
+            return NULL;
+            }
+         if(create && 0 != ftruncate(fd, JOURNAL_SEGMENT_SIZE))
+            {
+            MESSAGING_LOG_POSIX_ERROR;
+            ::close(fd);
+            return NULL;
+            }
+         TVoid *p = mmap(NULL, JOURNAL_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+         ::close(fd);
+         if(MAP_FAILED == p)
+            {
+            MESSAGING_LOG_POSIX_ERROR;
+            return NULL;
+            }
+         return (Tn8 *)p;
+         }
+
+      /*!
+       * Make sure the segment being appended to is the one we have mapped;
+       * another process may have rotated it.
+       */
+         static TBoolean
+      mapCurrent
+         (
+         TJournal *j
+         )
+         {
+         if(j->segment && j->mappedSegment == j->head->segment)
+            return TRUE;
+         if(j->segment)
+            {
+            msync(j->segment, JOURNAL_SEGMENT_SIZE, MS_SYNC);
+            munmap(j->segment, JOURNAL_SEGMENT_SIZE);
+            }
+         j->segment = mapSegment(j, j->head->segment, TRUE);
+         j->mappedSegment = j->head->segment;
+         return j->segment != NULL;
+         }
+
+      /*!
+       * Open, creating if need be, the journal of the agent with the argued
+       * name (a path) in directory.
+       * @return NULL on failure.
+       */
+         TJournal *
+      open
+         (
+         Tnc8 *directory,
+         Tnc8 *name
+         )
+         {
+         std::string base(directory);
+         base += '/';
+         for(; *name; name++)
+            base += *name == '/' ? '_' : *name;
+
+         std::string headPath = base + ".head";
+         int fd = ::open(headPath.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+         if(-1 == fd)
+            {
+            MESSAGING_LOG_ERROR("Cannot open \"%s\"", headPath.c_str());
+            MESSAGING_LOG_POSIX_ERROR;
+            return NULL;
+            }
+
+         flock(fd, LOCK_EX);
+         struct stat st;
+         if(0 != fstat(fd, &st) || (st.st_size < (off_t)sizeof(THead) && 0 != ftruncate(fd, sizeof(THead))))
+            {
+            MESSAGING_LOG_POSIX_ERROR;
+            flock(fd, LOCK_UN);
+            ::close(fd);
+            return NULL;
+            }
+         TVoid *p = mmap(NULL, sizeof(THead), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+         if(MAP_FAILED == p)
+            {
+            MESSAGING_LOG_POSIX_ERROR;
+            flock(fd, LOCK_UN);
+            ::close(fd);
+            return NULL;
+            }
+
+         THead *head = (THead *)p;
+         if(head->nextSequence == 0) // new journal
+            {
+            head->nextSequence = 1;
+            head->acknowledged = 0;
+            head->firstSegment = 0;
+            head->segment = 0;
+            head->position = 0;
+            msync(head, sizeof(THead), MS_SYNC);
+            }
+         flock(fd, LOCK_UN);
+
+         TJournal *j = new TJournal;
+         j->base = base;
+         j->headFd = fd;
+         j->head = head;
+         j->mappedSegment = 0;
+         j->segment = NULL;
+         j->uncommitted = 0;
+         j->lastSegment = 0;
+         j->lastPosition = 0;
+         return j;
+         }
+
+         TVoid
+      close
+         (
+         TJournal *j
+         )
+         {
+         commit(j);
+         if(j->segment)
+            munmap(j->segment, JOURNAL_SEGMENT_SIZE);
+         munmap(j->head, sizeof(THead));
+         ::close(j->headFd);
+         delete j;
+         }
+
+      /*!
+       * Add a record to the end of the journal.
+       * @param sequenceAt Where in record to write the sequence number the
+       * record is given, both in the journal and in the caller's copy.
+       * @return The sequence number, or -1 on failure.
+       */
+         Ts64
+      append
+         (
+         TJournal *j,
+         TVoid *record,
+         size_t length,
+         size_t sequenceAt
+         )
+         {
+         TRecordHeader header;
+         if(sizeof(header) + length > JOURNAL_SEGMENT_SIZE || sequenceAt + sizeof(Ts64) > length)
+            {
+            MESSAGING_LOG_ERROR("Cannot journal a record of %u bytes", length);
+            return -1;
+            }
+
+         flock(j->headFd, LOCK_EX);
+         THead *head = j->head;
+         if(head->position + sizeof(header) + length > JOURNAL_SEGMENT_SIZE)
+            {
+            head->segment++;
+            head->position = 0;
+            }
+         if(!mapCurrent(j))
+            {
+            flock(j->headFd, LOCK_UN);
+            return -1;
+            }
+
+         header.sequence = head->nextSequence++;
+         header.length = length;
+         memcpy((Tn8 *)record + sequenceAt, &header.sequence, sizeof(header.sequence));
+
+         // header last, so a record is never found half-written
+         Tn8 *p = j->segment + head->position;
+         memcpy(p + sizeof(header), record, length);
+         memcpy(p, &header, sizeof(header));
+         j->lastSegment = head->segment;
+         j->lastPosition = head->position;
+         head->position += sizeof(header) + length;
+         flock(j->headFd, LOCK_UN);
+
+         if(++j->uncommitted >= JOURNAL_GROUP_COMMIT)
+            commit(j);
+         return header.sequence;
+         }
+
+      /*!
+       * Take back the record this process appended last, e.g. because the
+       * message it holds could not be sent after all, so that it is not
+       * replayed.
+       */
+         TVoid
+      cancel
+         (
+         TJournal *j,
+         Ts64 sequence
+         )
+         {
+         flock(j->headFd, LOCK_EX);
+         TBoolean mapped = j->segment && j->mappedSegment == j->lastSegment;
+         Tn8 *segment = mapped ? j->segment : mapSegment(j, j->lastSegment, FALSE);
+         if(segment)
+            {
+            TRecordHeader header;
+            memcpy(&header, segment + j->lastPosition, sizeof(header));
+            if(header.sequence == sequence)
+               {
+               header.sequence = -sequence;
+               memcpy(segment + j->lastPosition, &header, sizeof(header));
+               }
+            if(!mapped)
+               munmap(segment, JOURNAL_SEGMENT_SIZE);
+            }
+         flock(j->headFd, LOCK_UN);
+         }
+
+      /*!
+       * Make everything appended so far durable.
+       */
+         TVoid
+      commit
+         (
+         TJournal *j
+         )
+         {
+         if(j->uncommitted == 0)
+            return;
+         if(j->segment)
+            msync(j->segment, JOURNAL_SEGMENT_SIZE, MS_SYNC);
+         msync(j->head, sizeof(THead), MS_SYNC);
+         j->uncommitted = 0;
+         }
+
+      /*!
+       * Record that every record up to and including sequence has been dealt
+       * with, and delete the segments that hold nothing else.
+       */
+         TVoid
+      acknowledge
+         (
+         TJournal *j,
+         Ts64 sequence
+         )
+         {
+         flock(j->headFd, LOCK_EX);
+         THead *head = j->head;
+         if(sequence > head->acknowledged)
+            head->acknowledged = sequence;
+
+         while(head->firstSegment < head->segment)
+            {
+            TRecordHeader next;
+            std::string path = segmentPath(j, head->firstSegment + 1);
+            int fd = ::open(path.c_str(), O_RDONLY);
+            ssize_t n = -1;
+            if(-1 != fd)
+               {
+               n = pread(fd, &next, sizeof(next), 0);
+               ::close(fd);
+               }
+            if(n != sizeof(next))
+               break;
+            // a segment is done with when the one after starts no later than
+            // the first unacknowledged record
+            Ts64 start = next.sequence < 0 ? -next.sequence : next.sequence;
+            if(start > head->acknowledged + 1)
+               break;
+            unlink(segmentPath(j, head->firstSegment).c_str());
+            head->firstSegment++;
+            }
+         msync(head, sizeof(THead), MS_ASYNC);
+         flock(j->headFd, LOCK_UN);
+         }
+
+      /*!
+       * Hand every unacknowledged record, oldest first, to handler, stopping
+       * early if it returns FALSE.
+       * @return The number of records handled.
+       */
+         size_t
+      replay
+         (
+         TJournal *j,
+         TReplayHandler handler,
+         TVoid *context
+         )
+         {
+         flock(j->headFd, LOCK_SH);
+         size_t first = j->head->firstSegment;
+         size_t last = j->head->segment;
+         Ts64 acknowledged = j->head->acknowledged;
+         Ts64 next = j->head->nextSequence;
+         flock(j->headFd, LOCK_UN);
+
+         size_t count = 0;
+         for(size_t s = first; s <= last; s++)
+            {
+            Tn8 *segment = mapSegment(j, s, FALSE);
+            if(!segment)
+               continue;
+
+            TBoolean more = TRUE;
+            size_t position = 0;
+            TRecordHeader header;
+            while(more && position + sizeof(header) <= JOURNAL_SEGMENT_SIZE)
+               {
+               memcpy(&header, segment + position, sizeof(header));
+               if(header.sequence == 0 || position + sizeof(header) + header.length > JOURNAL_SEGMENT_SIZE)
+                  break;
+               // cancelled records, being negative, are never replayed
+               if(header.sequence > acknowledged && header.sequence < next)
+                  {
+                  more = handler(segment + position + sizeof(header), header.length, context);
+                  if(more)
+                     count++;
+                  }
+               position += sizeof(header) + header.length;
+               }
+            munmap(segment, JOURNAL_SEGMENT_SIZE);
+            if(!more)
+               break;
+            }
+         return count;
+         }
+      }
+   }
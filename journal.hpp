@@ -0,0 +1,71 @@
+/*
+ * journal.hpp
+ *
+ *  Created on: Oct 18, 2026
+ */
+
+#ifndef JOURNAL_HPP_
+#define JOURNAL_HPP_
+
+#include <string>
+
+#include "include/aditypes.h"
+
+namespace msg
+   {
+   namespace journal
+      {
+      /*!
+       * Written at the start of the "head" file of a journal, shared by every
+       * process that has the journal open.
+       */
+      typedef struct
+         {
+         Ts64 nextSequence;
+         Ts64 acknowledged;
+         size_t firstSegment;
+         size_t segment;
+         size_t position;
+         } THead;
+
+      /*!
+       * Precedes every record in a segment. A record that was cancelled has
+       * its sequence negated.
+       */
+      typedef struct
+         {
+         Ts64 sequence;
+         size_t length;
+         } TRecordHeader;
+
+      typedef struct
+         {
+         std::string base;
+         int headFd;
+         THead *head;
+         size_t mappedSegment;
+         Tn8 *segment;
+         size_t uncommitted;
+         size_t lastSegment;  // where this process appended last, see cancel
+         size_t lastPosition;
+         } TJournal;
+
+      typedef TBoolean (*TReplayHandler)(const TVoid *record, size_t length, TVoid *context);
+
+      TJournal *open(Tnc8 *directory, Tnc8 *name);
+
+      TVoid close(TJournal *);
+
+      Ts64 append(TJournal *, TVoid *record, size_t length, size_t sequenceAt);
+
+      TVoid cancel(TJournal *, Ts64 sequence);
+
+      TVoid commit(TJournal *);
+
+      TVoid acknowledge(TJournal *, Ts64 sequence);
+
+      size_t replay(TJournal *, TReplayHandler, TVoid *context);
+      }
+   }
+
+#endif /* JOURNAL_HPP_ */
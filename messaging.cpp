@@ -67,16 +67,34 @@ rm /dev/mqueue/q_name
 
 #include <string>
 #include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
 #include <cmath>
+#include <new>
+#include <ctime>
+#include <sched.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "solib/base/file.hpp"
 #include "solib/hash/hash.hpp"
 
 #include "messaging.hpp"
 #include "represent.hpp"
+#include "journal.hpp"
+#include "socket.hpp"
+#include "registry.hpp"
+#include "capture.hpp"
+#include "timer.hpp"
 #include "log.hpp"
 
 #define CONFIG_FILE "./names.conf"
+#define NAME_REGISTRY "/dumbwaiter-names"
 
 #define _sender _bc.standard.sender
 #define _verb _bc.standard.verb
@@ -91,6 +109,44 @@ static TBoolean initialized = FALSE;
 
 #define L_FIELD_MAX 256
 
+/*!
+ * Every this many calls to appendChangesFrom for the same recipient and table
+ * sends every row in full so a receiver that missed something catches up.
+ */
+#define DELTA_SNAPSHOT_INTERVAL 64
+
+/*!
+ * How many released messages each thread keeps for TMsgHandle to reuse.
+ */
+#define MSG_POOL_MAX 64
+
+/*!
+ * The most recipients forward keeps open at once.
+ */
+#define FORWARD_OPEN_MAX 64
+
+/*!
+ * The most fields sendSegments passes to a socket without copying them.
+ */
+#define SEGMENTS_MAX 16
+
+/*!
+ * Resolution of sendAt, sendAfter and sendEvery.
+ */
+#define TIMER_TICK_US 1000
+
+/*!
+ * The longest a journaled message waits to be synced to disk, see
+ * setPersistent.
+ */
+#define JOURNAL_COMMIT_US 10000
+
+/*!
+ * The longest a message batched for a socket waits to be written, see
+ * setSocketBatching.
+ */
+#define SOCKET_FLUSH_US 1000
+
 namespace msg
    {
    const TAgentKey NOT_AN_AGENT = hash::getMaxKey();
@@ -101,12 +157,23 @@ namespace msg
    const TResourceKey RESOURCE_RESOURCE_NAME =  hash::getMaxKey()+3;
    const TResourceKey RESOURCE_RESOURCE_KEY =   hash::getMaxKey()+4;
    const TResourceKey RESOURCE_BANG =           hash::getMaxKey()+5;
+   const TResourceKey RESOURCE_STREAM =         hash::getMaxKey()+6;
+   const TResourceKey RESOURCE_SUBSCRIBE =      hash::getMaxKey()+7;
+   const TResourceKey RESOURCE_UNSUBSCRIBE =    hash::getMaxKey()+8;
+   const TResourceKey RESOURCE_CREDIT =         hash::getMaxKey()+9;
+   const TResourceKey RESOURCE_JOURNAL =        hash::getMaxKey()+10;
+   const TResourceKey RESOURCE_ATTACHMENT =     hash::getMaxKey()+11;
    const TResourceKey NO_MORE_RESOURCES =       hash::getMaxKey()+100;
 
 
    const size_t FIELD_HEADER_SIZE = 8;
 
+   const Ts32 FLAG_COALESCE = 0x1;
+
    std::map<TAgentKey, std::list<TMsg> > received_cache;
+   // flushed nodes of received_cache, spliced back in by receive so that
+   // receiving neither allocates nor copies
+   std::list<TMsg> received_spare;
    std::map<TAgentKey, mq_attr> attribute_cache;
    std::map<TAgentKey, Ts32> special_flags;
    std::map<TAgentKey, std::string> agent_names;
@@ -117,8 +184,230 @@ namespace msg
    std::map<TResourceKey, std::string> resource_names;
    std::map<TResourceKey, TResourceType> resource_types;
 
+   /*!
+    * Guards agent_names, resource_names and resource_types, so that names can
+    * be reloaded (see reloadNames) in one thread while others look them up.
+    * Held only while a map is read or added to; names once added are never
+    * changed, so what a lookup returns stays good after it is let go.
+    */
+   static volatile Ts32 names_lock = 0;
+
+      static TVoid
+   lockNames()
+      {
+      while(__sync_lock_test_and_set(&names_lock, 1))
+         sched_yield();
+      }
+
+      static TVoid
+   unlockNames()
+      {
+      __sync_lock_release(&names_lock);
+      }
+
+   /*!
+    * Where names came from, for reloadNames and watchNames, and how many have
+    * been registered by this process.
+    */
+   std::string config_path = CONFIG_FILE;
+   size_t names_version = 0;
+   int names_watch = -1;
+
+   /*!
+    * What was last sent of each table to each recipient by appendChangesFrom,
+    * cell by cell, and what the last call put in its message, which counts as
+    * sent once commitChanges says so.
+    */
+   typedef std::map<std::string, std::string> TRowSnapshot;
+   struct TTableSnapshot
+      {
+      TTableSnapshot() : syncCount(0), stagedPending(0) {}
+      size_t syncCount;
+      std::map<size_t, TRowSnapshot> rows;
+      std::map<size_t, TRowSnapshot> staged;
+      std::set<size_t> removed;
+      size_t stagedPending;
+      };
+   std::map<std::pair<TAgentKey, std::string>, TTableSnapshot> delta_cache;
+
+   std::map<TResourceKey, std::set<TAgentKey> > subscriptions;
+   std::map<std::string, std::set<TAgentKey> > pattern_subscriptions;
+
+   /*!
+    * One level of agent path, e.g. "remote" of "/remote/snmp", and the
+    * gateway or socket address, if any, for everything under it.
+    */
+   struct TRouteNode
+      {
+      TRouteNode() : gateway(NOT_AN_AGENT) {}
+      TAgentKey gateway;
+      std::string address; // see addSocketRoute
+      std::map<std::string, TRouteNode> children;
+      };
+   TRouteNode route_root;
+   std::map<TAgentKey, const TRouteNode *> route_cache;
+   // recipients opened by forward, least recently used first
+   std::list<TAgentKey> forward_opened;
+
+   std::map<std::string, sock::TConnection> socket_pool; // by address
+   std::list<int> socket_listeners;
+   std::list<sock::TConnection> socket_accepted;
+   TBoolean g_batchSockets = FALSE;
+
+   /*!
+    * Messages held back from a backed-up recipient with FLAG_COALESCE, oldest
+    * first, each with its coalescing key (see coalescingKey). Only SETs
+    * sent since the last message of another verb are found by key.
+    */
+   struct THeld
+      {
+      std::list<std::pair<std::string, TMsg> > messages;
+      std::map<std::string, std::list<std::pair<std::string, TMsg> >::iterator> byKey;
+      };
+   std::map<TAgentKey, THeld> held_cache;
+
+   /*!
+    * How many more messages each recipient in credit-based flow control
+    * (see setCredits) will take from us.
+    */
+   std::map<TAgentKey, size_t> credit_cache;
+
+   /*!
+    * How waitReceive waits for each agent, and what it has seen of the gaps
+    * between its messages.
+    */
+   struct TWaitState
+      {
+      TWaitState() : spinUs(0), yieldUs(0), adaptive(FALSE), lastArrivalUs(0), meanGapUs(0) {}
+      Ts64 spinUs;
+      Ts64 yieldUs;
+      TBoolean adaptive;
+      Ts64 lastArrivalUs;
+      Ts64 meanGapUs;
+      };
+   std::map<TAgentKey, TWaitState> wait_cache;
+
+   /*!
+    * Messages taken from an agent's queue for fair queuing (see
+    * setFairQueuing) but not yet received, from one sender.
+    */
+   struct TSenderQueue
+      {
+      TSenderQueue() : weight(1), deficit(0), perSecond(0), burst(0), tokens(0), refilledUs(0) {}
+      std::list<TMsg> messages;
+      Tu32 weight;
+      size_t deficit;   // bytes it may still be given this turn
+      size_t perSecond; // token bucket, see setSenderLimit
+      size_t burst;
+      Ts64 tokens;      // in millionths of a message
+      Ts64 refilledUs;
+      };
+   struct TFairQueue
+      {
+      TFairQueue() : quantum(0), count(0), credited(FALSE) {}
+      size_t quantum;
+      size_t count;
+      TBoolean credited; // whether active.front() has had its quantum this turn
+      std::map<TAgentKey, TSenderQueue> senders;
+      std::list<TAgentKey> active; // senders with messages waiting, in turn
+      };
+   std::map<TAgentKey, TFairQueue> fair_cache;
+
+   std::map<TAgentKey, journal::TJournal *> journal_cache;
+
+   /*!
+    * The sub-queues of an agent split with setPartitions, and the resource
+    * whose value decides which one a message goes into.
+    */
+   typedef struct
+      {
+      TResourceKey partitionKey;
+      std::vector<mqd_t> queues;
+      } TPartitions;
+   std::map<TAgentKey, TPartitions> partition_cache;
+
+   // capture files of agents whose traffic is being recorded, see setCapture
+   std::map<TAgentKey, int> capture_cache;
+
+   /*!
+    * What a timer in the timer wheel is for: a message to be sent (see
+    * sendAfter), or something to be done for an agent.
+    */
+   typedef enum
+      {
+      SCHEDULED_SEND,
+      SCHEDULED_RETRY,  // the agent's retry queue, see setRetry
+      SCHEDULED_COMMIT, // syncing the agent's journal, see setPersistent
+      SCHEDULED_HELD,   // the messages held back from the agent, see sendHeld
+      SCHEDULED_FLUSH   // batched socket writes, see setSocketBatching
+      } TScheduledKind;
+   typedef struct
+      {
+      timer::TTimer timer; // first, so that a TTimer * is a TScheduled *
+      size_t id;
+      Ts64 periodTicks;    // 0 unless sent with sendEvery
+      TScheduledKind kind;
+      TAgentKey agent;     // unless SCHEDULED_SEND
+      std::string message; // header and body, if SCHEDULED_SEND
+      } TScheduled;
+   timer::TWheel timer_wheel;
+   TBoolean timer_wheel_ready = FALSE;
+   std::map<size_t, TScheduled *> scheduled;
+   size_t scheduled_next_id = 1;
+   std::map<TAgentKey, size_t> commit_timers; // by recipient, see setPersistent
+   std::map<TAgentKey, size_t> held_timers;   // by recipient, see sendHeld
+   TBoolean flush_timer_pending = FALSE;
+
+   /*!
+    * Messages to a recipient with a TRetryPolicy that found its queue full,
+    * oldest first, and how often the oldest has been tried since.
+    */
+   struct TRetryQueue
+      {
+      std::list<TMsg> messages;
+      Tu32 attempts;
+      size_t timer; // see sendAfter
+      };
+   std::map<TAgentKey, TRetryPolicy> retry_policies;
+   std::map<TAgentKey, TRetryQueue> retry_cache; // only while not empty
+
+   /*!
+    * Value of a RESOURCE_ATTACHMENT field: where to find a payload too large
+    * to go in the message itself.
+    */
+   typedef struct
+      {
+      TResourceKey resource;
+      size_t length;
+      Tn8 name[32];
+      Ts32 mapped; // by the recipient of this copy, see mapAttachment
+      } TAttachment;
+
+   /*!
+    * Start of an attachment's segment, ahead of the payload: how many holds
+    * there are on it, the sender's (see releaseAttachments) and one for each
+    * message carrying it that has been delivered but neither mapped nor
+    * dropped. Whoever takes away the last removes the segment.
+    */
+   typedef struct
+      {
+      volatile Ts32 refs;
+      } TAttachmentHeader;
+#define ATTACHMENT_OFFSET 64
+
    TBoolean g_doRep = FALSE;
 
+   /*!
+    * Value of the RESOURCE_STREAM field that leads every chunk of a table
+    * transfer (see sendTable).
+    */
+   typedef struct
+      {
+      size_t sequence;
+      size_t rowCount;
+      TBoolean last;
+      } TStreamHeader;
+
 #ifdef SOLIPSISM
    int solip_imqd = 0;
 #endif
@@ -131,6 +420,9 @@ namespace msg
       {
       if(string != NULL)
          {
+         // names.conf spells them as in net-snmp, e.g. ASN_INTEGER
+         if(strncasecmp(string, "ASN_", 4) == 0)
+            string += 4;
          if(strcasecmp(string, "OCTET_STR") == 0)
             return OCTET_STR;
          if(strcasecmp(string, "BOOLEAN") == 0)
@@ -196,7 +488,7 @@ namespace msg
          TResourceKey key
          )
          {
-         return resource_names[key].c_str();
+         return getResourceName(key);
          }
       }
 
@@ -220,6 +512,94 @@ namespace msg
       _valid = VALID_BITMASK;
       }
 
+   // singly linked through the first bytes of each free message
+   static __thread TVoid *msg_pool = NULL;
+   static __thread size_t msg_pool_size = 0;
+
+      static TVoid *
+   acquireMsg()
+      {
+      TVoid *storage = msg_pool;
+      if(storage)
+         {
+         msg_pool = *(TVoid **)storage;
+         msg_pool_size--;
+         }
+      else
+         storage = ::operator new(sizeof(TMsg));
+      return storage;
+      }
+
+      static TVoid
+   recycleMsg
+      (
+      TMsg *message
+      )
+      {
+      message->~TMsg();
+      if(msg_pool_size < MSG_POOL_MAX)
+         {
+         *(TVoid **)message = msg_pool;
+         msg_pool = message;
+         msg_pool_size++;
+         }
+      else
+         ::operator delete(message);
+      }
+
+   TMsgHandle::TMsgHandle()
+      {
+      _msg = new(acquireMsg()) TMsg();
+      }
+
+   TMsgHandle::TMsgHandle
+      (
+      TRestVerb verb
+      )
+      {
+      _msg = new(acquireMsg()) TMsg(verb);
+      }
+
+   TMsgHandle::TMsgHandle
+      (
+      const TMsgHandle &other
+      )
+      {
+      _msg = other._msg;
+      other._msg = NULL;
+      }
+
+      TMsgHandle &
+   TMsgHandle::operator=
+      (
+      const TMsgHandle &other
+      )
+      {
+      if(this != &other)
+         {
+         reset();
+         _msg = other._msg;
+         other._msg = NULL;
+         }
+      return *this;
+      }
+
+   TMsgHandle::~TMsgHandle()
+      {
+      reset();
+      }
+
+   /*!
+    * Give the message back to the pool, leaving the handle empty.
+    */
+      TVoid
+   TMsgHandle::reset()
+      {
+      if(_msg)
+         recycleMsg(_msg);
+      _msg = NULL;
+      }
+
       TRestVerb
    TMsg::getVerb()
       {
@@ -308,7 +688,7 @@ namespace msg
       _bodySize += length;
       if(_bodySize > getMaxBodySize(_recipient))
           {
-          MESSAGING_LOG_ERROR("Message size (%u bytes) exceeds maximum limit of %ld bytes! Truncating and invalidating.", _bodySize, msg::attribute_cache[_recipient].mq_msgsize);
+          MESSAGING_LOG_ERROR("Message size (%u bytes) exceeds maximum limit of %ld bytes! Truncating and invalidating.", _bodySize, (long)getMaxBodySize(_recipient));
           _bodySize = originalBodySize;
           invalidate();
           }
@@ -354,6 +734,42 @@ namespace msg
       append(rkey, length, value);
       }
 
+      TVoid
+   TMsg::appendRow
+      (
+      Data::TBase &db,
+      Tnc8 *tableName,
+      Tnc8 **colNames, // Null-delimited
+      size_t dbIndex
+      )
+      {
+      size_t iCol = 0;
+      while(colNames && colNames[iCol])
+         {
+         setVerb((TRestVerb)Data::GetInteger(db, tableName, "verb", dbIndex));
+         if(Data::HasString(db, tableName, colNames[iCol], dbIndex))
+            {
+            Tnc8 *s = Data::GetString(db, tableName, colNames[iCol], dbIndex);
+            appendString(msg::getResourceKey(colNames[iCol]), strlen(s), s);
+            }
+         else if(Data::HasInteger(db, tableName, colNames[iCol], dbIndex))
+            {
+            TResourceKey rkey = msg::getResourceKey(colNames[iCol]);
+            if(getResourceType(rkey) == COUNTER64)
+               {
+               put<Ts64>(rkey, Data::GetInteger(db, tableName, colNames[iCol], dbIndex));
+               }
+            else
+               {
+               Ts32 integer = (Ts32)Data::GetInteger(db, tableName, colNames[iCol], dbIndex);
+               //MESSAGING_LOG_INFO("%s:%s(%u).%u = %ld", tableName, colNames[iCol], rkey, dbIndex, integer);
+               appendInteger(rkey, 32 / 8, integer);
+               }
+            }
+         iCol++;
+         }
+      }
+
       size_t
    TMsg::appendFrom
       (
@@ -369,25 +785,261 @@ namespace msg
          dbIndex = db.next(tableName, dbIndex)
          )
          {
-         size_t iCol = 0;
-         while(colNames && colNames[iCol])
+         appendRow(db, tableName, colNames, dbIndex);
+         }
+      return getBodySize();
+      }
+
+      static TVoid
+   readRow
+      (
+      Data::TBase &db,
+      Tnc8 *tableName,
+      Tnc8 **colNames,
+      size_t dbIndex,
+      TRowSnapshot *row
+      )
+      {
+      Ts32 verb = (Ts32)Data::GetInteger(db, tableName, "verb", dbIndex);
+      (*row)["verb"].assign((Tnc8 *)&verb, sizeof(verb));
+      for(size_t iCol = 0; colNames && colNames[iCol]; iCol++)
+         {
+         if(Data::HasString(db, tableName, colNames[iCol], dbIndex))
+            {
+            (*row)[colNames[iCol]] = Data::GetString(db, tableName, colNames[iCol], dbIndex);
+            }
+         else if(Data::HasInteger(db, tableName, colNames[iCol], dbIndex))
+            {
+            Ts64 integer = Data::GetInteger(db, tableName, colNames[iCol], dbIndex);
+            (*row)[colNames[iCol]].assign((Tnc8 *)&integer, sizeof(integer));
+            }
+         }
+      }
+
+   /*!
+    * Like appendFrom, but only the cells that changed since the last call for
+    * this recipient and table, each row led by its index column and followed
+    * by a bang. extractInto applies the result like any other message since it
+    * only ever sets the cells it finds. Rows that have left the table are sent
+    * as their index alone, with REST_DELETE. As with appendStreamFrom, a
+    * message never mixes verbs. Every DELTA_SNAPSHOT_INTERVAL calls, or after
+    * resync, every row is sent in full.
+    *
+    * What goes in the message counts as sent only once commitChanges is
+    * called, so if the message cannot be sent the next call has it again.
+    * @param indexKey The key of the index column, which is always sent.
+    * @return The number of changed rows that did not fit and will go out with
+    * the next call.
+    */
+      size_t
+   TMsg::appendChangesFrom
+      (
+      Data::TBase &db,
+      Tnc8 *tableName,
+      Tnc8 **colNames, // Null-delimited
+      TResourceKey indexKey
+      )
+      {
+      TTableSnapshot &snapshot = delta_cache[std::make_pair(_recipient, std::string(tableName))];
+      TBoolean full = snapshot.syncCount % DELTA_SNAPSHOT_INTERVAL == 0;
+      snapshot.staged.clear();
+      snapshot.removed.clear();
+
+      size_t pending = 0;
+      TBoolean haveVerb = FALSE;
+      std::set<size_t> seen;
+      size_t dbIndex;
+      for(
+         dbIndex = db.begin(tableName);
+         dbIndex < db.end(tableName);
+         dbIndex = db.next(tableName, dbIndex)
+         )
+         {
+         seen.insert(dbIndex);
+         std::map<size_t, TRowSnapshot>::iterator last = snapshot.rows.find(dbIndex);
+         TBoolean known = !full && last != snapshot.rows.end();
+         TRowSnapshot current;
+         readRow(db, tableName, colNames, dbIndex, &current);
+
+         std::vector<Tnc8 *> changed;
+         TBoolean anyChanged = !known || last->second["verb"] != current["verb"];
+         TBoolean haveIndex = FALSE;
+         for(size_t iCol = 0; colNames && colNames[iCol]; iCol++)
             {
-            setVerb((TRestVerb)Data::GetInteger(db, tableName, "verb", dbIndex));
-            if(Data::HasString(db, tableName, colNames[iCol], dbIndex))
+            Tnc8 *col = colNames[iCol];
+            if(msg::getResourceKey(col) == indexKey)
                {
-               Tnc8 *s = Data::GetString(db, tableName, colNames[iCol], dbIndex);
-               appendString(msg::getResourceKey(colNames[iCol]), strlen(s), s);
+               changed.insert(changed.begin(), col);
+               haveIndex = TRUE;
                }
-            else if(Data::HasInteger(db, tableName, colNames[iCol], dbIndex))
+            else if(!known || last->second[col] != current[col])
                {
-               Ts32 integer = (Ts32)Data::GetInteger(db, tableName, colNames[iCol], dbIndex);
-               //MESSAGING_LOG_INFO("%s:%s(%u).%u = %ld", tableName, colNames[iCol], msg::getResourceKey(colNames[iCol]), dbIndex, integer);
-               appendInteger(msg::getResourceKey(colNames[iCol]), 32 / 8, integer);
+               changed.push_back(col);
+               anyChanged = TRUE;
                }
-            iCol++;
             }
+         if(!anyChanged)
+            continue;
+         changed.push_back(NULL);
+
+         if(pending > 0)
+            {
+            pending++;
+            continue;
+            }
+
+         TMsg row((TRestVerb)Data::GetInteger(db, tableName, "verb", dbIndex));
+         row.setRecipient(getRecipient());
+         // a row must say which it is even if its index column is not sent
+         if(!haveIndex)
+            row.appendInteger(indexKey, 32 / 8, (Ts32)dbIndex);
+         row.appendRow(db, tableName, &changed[0], dbIndex);
+         row.appendBang();
+         if(!row.isValid()
+               || (haveVerb && row.getVerb() != getVerb())
+               || _bodySize + row.getBodySize() >= getMaxBodySize(_recipient))
+            {
+            pending++;
+            continue;
+            }
+
+         memcpy(_body + _bodySize, row.getBody(), row.getBodySize());
+         _bodySize += row.getBodySize();
+         setVerb(row.getVerb());
+         haveVerb = TRUE;
+         snapshot.staged[dbIndex] = current;
          }
-      return getBodySize();
+
+      // rows that have left the table
+      std::map<size_t, TRowSnapshot>::iterator it;
+      for(it = snapshot.rows.begin(); it != snapshot.rows.end(); it++)
+         {
+         if(seen.count(it->first))
+            continue;
+         TMsg row(REST_DELETE);
+         row.appendInteger(indexKey, 32 / 8, (Ts32)it->first);
+         row.appendBang();
+         if(pending > 0
+               || (haveVerb && getVerb() != REST_DELETE)
+               || _bodySize + row.getBodySize() >= getMaxBodySize(_recipient))
+            {
+            pending++;
+            continue;
+            }
+         memcpy(_body + _bodySize, row.getBody(), row.getBodySize());
+         _bodySize += row.getBodySize();
+         setVerb(REST_DELETE);
+         haveVerb = TRUE;
+         snapshot.removed.insert(it->first);
+         }
+
+      snapshot.stagedPending = pending;
+      return pending;
+      }
+
+   /*!
+    * Take what the last appendChangesFrom for this recipient and table put in
+    * its message as sent, once it has been.
+    */
+      TVoid
+   commitChanges
+      (
+      TAgentKey recipient,
+      Tnc8 *tableName
+      )
+      {
+      std::map<std::pair<TAgentKey, std::string>, TTableSnapshot>::iterator found =
+            delta_cache.find(std::make_pair(recipient, std::string(tableName)));
+      if(found == delta_cache.end())
+         return;
+      TTableSnapshot &snapshot = found->second;
+      std::map<size_t, TRowSnapshot>::iterator it;
+      for(it = snapshot.staged.begin(); it != snapshot.staged.end(); it++)
+         snapshot.rows[it->first] = it->second;
+      std::set<size_t>::iterator removed;
+      for(removed = snapshot.removed.begin(); removed != snapshot.removed.end(); removed++)
+         snapshot.rows.erase(*removed);
+      // a full resend only counts once every row has gone out
+      if(snapshot.syncCount % DELTA_SNAPSHOT_INTERVAL != 0 || snapshot.stagedPending == 0)
+         snapshot.syncCount++;
+      snapshot.staged.clear();
+      snapshot.removed.clear();
+      }
+
+   /*!
+    * Make the next appendChangesFrom for this recipient and table send every
+    * row, e.g. because the recipient restarted.
+    */
+      TVoid
+   resync
+      (
+      TAgentKey recipient,
+      Tnc8 *tableName
+      )
+      {
+      delta_cache.erase(std::make_pair(recipient, std::string(tableName)));
+      }
+
+   /*!
+    * Append as many whole rows as will fit, each followed by a bang, starting
+    * at dbIndex. The chunk is led by a RESOURCE_STREAM field so that the
+    * receiver can tell the chunks of a table transfer apart. A chunk never
+    * mixes verbs, so every row keeps its own verb through extractInto. A row
+    * too large for a chunk of its own invalidates the message rather than be
+    * left out.
+    * @return The database index of the first row that did not make it into
+    * this message, i.e. where the next chunk should start.
+    */
+      size_t
+   TMsg::appendStreamFrom
+      (
+      Data::TBase &db,
+      Tnc8 *tableName,
+      Tnc8 **colNames, // Null-delimited
+      size_t dbIndex,
+      size_t sequence
+      )
+      {
+      TStreamHeader header;
+      header.sequence = sequence;
+      header.rowCount = 0;
+      header.last = FALSE;
+
+      Tn8 *pHeader = reserve(RESOURCE_STREAM, sizeof(header));
+      if(pHeader == NULL)
+         {
+         invalidate();
+         return dbIndex;
+         }
+
+      TBoolean haveVerb = FALSE;
+      for(; dbIndex < db.end(tableName); dbIndex = db.next(tableName, dbIndex))
+         {
+         TMsg row;
+         row.setRecipient(getRecipient());
+         row.appendRow(db, tableName, colNames, dbIndex);
+         row.appendBang();
+         if(haveVerb && row.isValid() && row.getVerb() != getVerb())
+            break;
+         if(!row.isValid() || _bodySize + row.getBodySize() >= getMaxBodySize(_recipient))
+            {
+            if(header.rowCount > 0)
+               break;
+            MESSAGING_LOG_ERROR("Row %u of %s does not fit in a single message", dbIndex, tableName);
+            invalidate();
+            return dbIndex;
+            }
+
+         memcpy(_body + _bodySize, row.getBody(), row.getBodySize());
+         _bodySize += row.getBodySize();
+         setVerb(row.getVerb());
+         haveVerb = TRUE;
+         header.rowCount++;
+         }
+
+      header.last = dbIndex >= db.end(tableName);
+      memcpy(pHeader, &header, sizeof(header));
+      return dbIndex;
       }
 
       TVoid
@@ -406,7 +1058,7 @@ namespace msg
       size_t newBodySize = _bodySize + sizeof(rkey) + sizeof(fieldLength) + fieldLength;
       if(_bodySize + sizeof(rkey) + sizeof(fieldLength) + fieldLength >=  getMaxBodySize(_recipient))
          {
-         MESSAGING_LOG_ERROR("New payload size (%u bytes) exceeds maximum limit of %ld bytes! Truncating.", newBodySize, msg::attribute_cache[_recipient].mq_msgsize);
+         MESSAGING_LOG_ERROR("New payload size (%u bytes) exceeds maximum limit of %ld bytes! Truncating.", newBodySize, (long)getMaxBodySize(_recipient));
          return NULL;
          }
 
@@ -421,15 +1073,146 @@ namespace msg
       return _body + reservationStart;
       }
 
-      TVoid
-   TMsg::constrict
+   /*!
+    * Make room for length bytes of rkey outside the message, in a shared
+    * memory segment, for payloads too large for a field. Only a handle goes in
+    * the message; the recipient maps the same memory with mapAttachment, so
+    * the payload is never copied. The segment lasts until the message has
+    * been sent, to however many recipients, and releaseAttachments called,
+    * and every copy delivered has been mapped or dropped.
+    * @return Where to write the payload, to be unmapped with
+    * releaseAttachment, or NULL on failure.
+    */
+      Tn8*
+   TMsg::reserveAttachment
       (
-      size_t oldFieldLength,
-      size_t fieldLength
+      TResourceKey rkey,
+      size_t length
       )
       {
-      size_t fieldStart = _bodySize - oldFieldLength;
-      size_t fieldIndex = sizeof(TResourceKey);
+      static size_t count = 0;
+      if(length == 0)
+         {
+         MESSAGING_LOG_ERROR("Attachment of no length");
+         return NULL;
+         }
+      TAttachment attachment;
+      memset(&attachment, 0, sizeof(attachment));
+      attachment.resource = rkey;
+      attachment.length = length;
+      snprintf(attachment.name, sizeof(attachment.name), "/dw-%ld-%lu", (long)getpid(), (unsigned long)count++);
+
+      int fd = shm_open(attachment.name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+      if(-1 == fd)
+         {
+         MESSAGING_LOG_POSIX_ERROR;
+         return NULL;
+         }
+      TVoid *p = MAP_FAILED;
+      if(0 == ftruncate(fd, ATTACHMENT_OFFSET + length))
+         p = mmap(NULL, ATTACHMENT_OFFSET + length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      close(fd);
+      if(MAP_FAILED == p)
+         {
+         MESSAGING_LOG_POSIX_ERROR;
+         shm_unlink(attachment.name);
+         return NULL;
+         }
+      ((TAttachmentHeader *)p)->refs = 1;
+
+      append(RESOURCE_ATTACHMENT, sizeof(attachment), &attachment);
+      if(!isValid())
+         {
+         munmap(p, ATTACHMENT_OFFSET + length);
+         shm_unlink(attachment.name);
+         return NULL;
+         }
+      return (Tn8 *)p + ATTACHMENT_OFFSET;
+      }
+
+   /*!
+    * reserveAttachment and copy value in. As with reserveAttachment, call
+    * releaseAttachments once the message is sent.
+    */
+      TBoolean
+   TMsg::attach
+      (
+      TResourceKey rkey,
+      size_t length,
+      const TVoid *value
+      )
+      {
+      Tn8 *p = reserveAttachment(rkey, length);
+      if(p == NULL)
+         return FALSE;
+      memcpy(p, value, length);
+      releaseAttachment(p, length);
+      return TRUE;
+      }
+
+   /*!
+    * Map the payload attached as rkey, read-only, to be unmapped with
+    * releaseAttachment. Each copy of the message delivered may be mapped
+    * once; mapping lets go of its hold on the segment (see
+    * TAttachmentHeader), which goes away when nothing else holds it.
+    * @return The payload, or NULL if there is none.
+    */
+      const TVoid*
+   TMsg::mapAttachment
+      (
+      TResourceKey rkey,
+      size_t *length
+      )
+      {
+      size_t iBody;
+      for(iBody = 0; iBody < _bodySize; iBody = getNextFieldOffset(iBody))
+         {
+         TAttachment attachment;
+         if(getResourceKey(iBody) != RESOURCE_ATTACHMENT || getFieldSize(iBody) != sizeof(attachment))
+            continue;
+         memcpy(&attachment, getFieldPointer(iBody), sizeof(attachment));
+         if(attachment.resource != rkey)
+            continue;
+
+         if(attachment.mapped)
+            {
+            MESSAGING_LOG_ERROR("Attachment already mapped");
+            return NULL;
+            }
+         attachment.name[sizeof(attachment.name) - 1] = '\0';
+         int fd = shm_open(attachment.name, O_RDWR, 0);
+         if(-1 == fd)
+            {
+            MESSAGING_LOG_POSIX_ERROR;
+            return NULL;
+            }
+         TVoid *p = mmap(NULL, ATTACHMENT_OFFSET + attachment.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+         close(fd);
+         if(MAP_FAILED == p)
+            {
+            MESSAGING_LOG_POSIX_ERROR;
+            return NULL;
+            }
+         attachment.mapped = TRUE;
+         memcpy((Tn8 *)getFieldPointer(iBody), &attachment, sizeof(attachment));
+         if(0 == __sync_sub_and_fetch(&((TAttachmentHeader *)p)->refs, 1))
+            shm_unlink(attachment.name);
+         if(length)
+            *length = attachment.length;
+         return (Tn8 *)p + ATTACHMENT_OFFSET;
+         }
+      return NULL;
+      }
+
+      TVoid
+   TMsg::constrict
+      (
+      size_t oldFieldLength,
+      size_t fieldLength
+      )
+      {
+      size_t fieldStart = _bodySize - oldFieldLength;
+      size_t fieldIndex = sizeof(TResourceKey);
       size_t sizeOfValue;
       memcpy(&sizeOfValue, _body + fieldStart + fieldIndex, sizeof(sizeOfValue));
       if(sizeOfValue != oldFieldLength)
@@ -455,8 +1238,7 @@ namespace msg
       {
       size_t keySize = sizeof(TResourceKey);
       size_t fieldIndex = keySize;
-      size_t sizeOfValue = 0;
-      memcpy(&sizeOfValue, _body + fieldStart + fieldIndex, sizeof(sizeOfValue));
+      size_t sizeOfValue = getFieldSize(fieldStart);
       fieldIndex += sizeof(sizeOfValue);
 
       memcpy(value, _body + fieldStart + fieldIndex, sizeOfValue);
@@ -470,9 +1252,14 @@ namespace msg
       size_t fieldStart
       )
       {
+      // 64-bit counters are never represented differently, so are only read
+      if(getFieldSize(fieldStart) == sizeof(Ts64))
+         return get<Ts64>(fieldStart);
+
       Ts32 integer = 0;
       TResourceType rtype = INTEGER;
-      extract(&integer, fieldStart);
+      if(getFieldSize(fieldStart) <= sizeof(integer))
+         extract(&integer, fieldStart);
 
       if(g_doRep)
          rtype = getResourceType(getResourceKey(fieldStart));
@@ -549,6 +1336,13 @@ namespace msg
       Tn8 *pBuf = buffer;
       size_t fieldIndex = 0;
 
+      size_t bodySize = _bodySize < MESSAGE_BODY_MEM_SIZE ? _bodySize : MESSAGE_BODY_MEM_SIZE;
+      if(fieldStart > bodySize || bodySize - fieldStart < sizeof(TResourceKey) + sizeof(size_t))
+         {
+         MESSAGING_LOG_ERROR("No field at offset %u", fieldStart);
+         return;
+         }
+
       TResourceKey rkey = 0;
       memcpy(&rkey, _body + fieldStart, sizeof(TResourceKey));
       pBuf += sprintf(pBuf, "rkey: \"%s\" (%u)\n", msg::getResourceName(rkey), rkey);
@@ -559,20 +1353,34 @@ namespace msg
       pBuf += sprintf(pBuf, "vsize: %u\n", sizeOfValue);
       fieldIndex += sizeof(sizeOfValue);
 
-      size_t iBody;
+      // getFieldSize is 0 for a value running past the body
+      size_t valueSize = getFieldSize(fieldStart);
       size_t iChunk;
-      for(iBody = fieldIndex, iChunk = 0; iBody < getBodySize() && iChunk < maxChunk && iChunk < getFieldSize(iBody); iBody++, iChunk++)
+      for(iChunk = 0; iChunk < maxChunk && iChunk < valueSize; iChunk++)
          {
-         Tn8 d = _body[iBody];
+         Tn8 d = _body[fieldStart + fieldIndex + iChunk];
          pBuf += sprintf(pBuf, "%3d ", d);
          if(iChunk && iChunk % 8 == 0)
             pBuf += sprintf(pBuf, "\n");
          }
-      if(iChunk < maxChunk && iChunk < getFieldSize(iBody))
+      if(iChunk == valueSize)
          sprintf(pBuf, "end");
       MESSAGING_LOG_INFO("\n%s", buffer);
       }
 
+   /*!
+    * Whether rkey is one of the keys the library adds to messages for its own
+    * use (RESOURCE_STREAM, RESOURCE_JOURNAL etc.) rather than application data.
+    */
+      static TBoolean
+   isControlResource
+      (
+      TResourceKey rkey
+      )
+      {
+      return rkey > NOT_A_RESOURCE && rkey < NO_MORE_RESOURCES && rkey != RESOURCE_BANG;
+      }
+
       size_t
    TMsg::extractInto
       (
@@ -581,71 +1389,85 @@ namespace msg
       TResourceKey indexKey
       )
       {
-      size_t iBody = 0;
-      TResourceKey rkey = getResourceKey(iBody);
+      TResourceKey rkey;
       size_t currentIdx = 1;
+      TBoolean rowOpen = FALSE;
       Data::SetInteger(db, "indexeRKs", tableName, 0, indexKey);
 
-      for(; iBody < getBodySize(); iBody = getNextFieldOffset(iBody))
+      TFieldCursor field(*this);
+      for(; field.valid(); field.next())
          {
-         for(;
-             !isBang(iBody) && iBody < getBodySize();
-             iBody = getNextFieldOffset(iBody) // jump to next field
-            )
+         if(field.isBang())
             {
-            MESSAGING_LOG_INFO("iBody = %u", iBody);
-            rkey = getResourceKey(iBody);
-            //MESSAGING_LOG_INFO("1 iBody = %u, fieldSize = %u", iBody, getFieldSize(iBody));
-            switch(getResourceType(rkey))
+            //MESSAGING_LOG_INFO("%s verb %u = %s", tableName, currentIdx, RestVerbToString(getVerb()));
+            Data::SetInteger(db, tableName, "verb", currentIdx, getVerb());
+            rowOpen = FALSE;
+            continue;
+            }
+
+         size_t iBody = field.offset();
+         MESSAGING_LOG_INFO("iBody = %u", iBody);
+         rkey = field.key();
+         rowOpen = TRUE;
+         if(isControlResource(rkey))
+            continue;
+         //MESSAGING_LOG_INFO("1 iBody = %u, fieldSize = %u", iBody, field.length());
+         switch(getResourceType(rkey))
+            {
+            case UNKNOWN_TYPE:
                {
-               case UNKNOWN_TYPE:
-                  {
-                  MESSAGING_LOG_ERROR("Found a resource of unknown type. Dumping message contents.");
-                  dump(iBody);
-                  }
-                  break;
-               case OCTET_STR:
-               case OPAQUE:
-               case IPADDRESS:
+               MESSAGING_LOG_ERROR("Found a resource of unknown type. Dumping message contents.");
+               dump(iBody);
+               }
+               break;
+            case OCTET_STR:
+            case OPAQUE:
+            case IPADDRESS:
+               {
+               Tn8 buffer[L_FIELD_MAX+1];
+               //MESSAGING_LOG_INFO("2 iBody = %u, fieldSize = %u", iBody, field.length());
+               size_t len = extractString(buffer, L_FIELD_MAX, iBody);
+               buffer[len] = '\0';
+               MESSAGING_LOG_INFO("%s %s %u = \"%s\", length = %u", tableName, getResourceName(rkey), currentIdx, buffer, len);
+               Data::SetString(db, tableName, getResourceName(rkey), currentIdx, buffer, len);
+               dump(iBody);
+               }
+               break;
+            case OBJECT_ID:
+               {
+               if(rkey == indexKey)
                   {
-                  Tn8 buffer[L_FIELD_MAX+1];
-                  //MESSAGING_LOG_INFO("2 iBody = %u, fieldSize = %u", iBody, getFieldSize(iBody));
-                  size_t len = extractString(buffer, L_FIELD_MAX, iBody);
-                  buffer[len] = '\0';
-                  MESSAGING_LOG_INFO("%s %s %u = \"%s\", length = %u", tableName, getResourceName(rkey), currentIdx, buffer, len);
-                  Data::SetString(db, tableName, getResourceName(rkey), currentIdx, buffer, len);
-                  dump(iBody);
-                  }
+                  currentIdx = extractInteger(iBody);
+                  MESSAGING_LOG_INFO("%s %s = %u", tableName, getResourceName(rkey), currentIdx);
+                  Data::SetInteger(db, tableName, getResourceName(rkey), currentIdx, currentIdx);
                   break;
-               case OBJECT_ID:
-                  {
-                  if(rkey == indexKey)
-                     {
-                     currentIdx = extractInteger(iBody);
-                     MESSAGING_LOG_INFO("%s %s = %u", tableName, getResourceName(rkey), currentIdx);
-                     Data::SetInteger(db, tableName, getResourceName(rkey), currentIdx, currentIdx);
-                     break;
-                     }
-                  //MESSAGING_LOG_INFO("OBJECT_ID %s:%s = %u", tableName, getResourceName(rkey), currentIdx);
-                  }
-               default:
-                  {
-                  Ts32 integer = extractInteger(iBody);
-                  //MESSAGING_LOG_INFO("3 iBody = %u, fieldSize = %u", iBody, getFieldSize(iBody));
-                  MESSAGING_LOG_INFO("%s %s %u = %ld", tableName, getResourceName(rkey), currentIdx, integer);
-                  Data::SetInteger(db, tableName, getResourceName(rkey), currentIdx, integer);
-                  dump(iBody);
                   }
+               //MESSAGING_LOG_INFO("OBJECT_ID %s:%s = %u", tableName, getResourceName(rkey), currentIdx);
+               }
+            default:
+               {
+               Ts64 integer = extractInteger(iBody);
+               //MESSAGING_LOG_INFO("3 iBody = %u, fieldSize = %u", iBody, field.length());
+               MESSAGING_LOG_INFO("%s %s %u = %ld", tableName, getResourceName(rkey), currentIdx, integer);
+               Data::SetInteger(db, tableName, getResourceName(rkey), currentIdx, integer);
+               dump(iBody);
                }
             }
-         //MESSAGING_LOG_INFO("%s verb %u = %s", tableName, currentIdx, RestVerbToString(getVerb()));
+         }
 
+      // the last row needn't be followed by a bang
+      if(rowOpen)
          Data::SetInteger(db, tableName, "verb", currentIdx, getVerb());
-         }
-      return iBody;
+      if(field.isMalformed())
+         MESSAGING_LOG_ERROR("Malformed field at offset %u", field.offset());
+      return field.offset();
       }
 
 
+   /*!
+    * @return The length of the field's value, or 0 if the field does not fit
+    * in the body, i.e. the message is malformed.
+    */
       size_t
    TMsg::getFieldSize
       (
@@ -655,7 +1477,15 @@ namespace msg
       size_t keySize = sizeof(TResourceKey);
       size_t fieldIndex = keySize;
       size_t sizeOfField;
+      size_t bodySize = _bodySize < MESSAGE_BODY_MEM_SIZE ? _bodySize : MESSAGE_BODY_MEM_SIZE;
+      if(fieldStart > bodySize || bodySize - fieldStart < fieldIndex + sizeof(sizeOfField))
+         return 0;
       memcpy(&sizeOfField, _body + fieldStart + fieldIndex, sizeof(sizeOfField));
+      if(sizeOfField > bodySize - fieldStart - fieldIndex - sizeof(sizeOfField))
+         {
+         MESSAGING_LOG_ERROR("Field at offset %u claims %u bytes, more than the body holds", fieldStart, sizeOfField);
+         return 0;
+         }
       return sizeOfField;
       }
 
@@ -688,15 +1518,16 @@ namespace msg
       {
       size_t offset = 0;
       size_t valueSize = 0;
-      if(fieldStart + offset >= _bodySize)
+      size_t bodySize = _bodySize < MESSAGE_BODY_MEM_SIZE ? _bodySize : MESSAGE_BODY_MEM_SIZE;
+      if(fieldStart >= bodySize || bodySize - fieldStart < sizeof(TResourceKey) + sizeof(size_t))
          return _bodySize;
       offset += sizeof(TResourceKey);
-      if(fieldStart + offset >= _bodySize)
-         return _bodySize;
       memcpy(&valueSize, _body+fieldStart+offset, sizeof(size_t));
       offset+=sizeof(size_t);
       offset += valueSize;
 
+      if(fieldStart + offset > bodySize || fieldStart + offset < fieldStart)
+         return _bodySize; // malformed, there is nothing more to be had
       return fieldStart + offset;
       }
 
@@ -711,7 +1542,8 @@ namespace msg
    TMsg::getResourceKey(size_t fieldStart)
       {
       TResourceKey key = NOT_A_RESOURCE;
-      if(fieldStart + sizeof(TResourceKey) > _bodySize)
+      size_t bodySize = _bodySize < MESSAGE_BODY_MEM_SIZE ? _bodySize : MESSAGE_BODY_MEM_SIZE;
+      if(fieldStart > bodySize || bodySize - fieldStart < sizeof(TResourceKey))
          return NO_MORE_RESOURCES;
       memcpy(&key, _body+fieldStart, sizeof(key));
       if(key > NO_MORE_RESOURCES)
@@ -725,6 +1557,129 @@ namespace msg
       return getResourceKey(fieldStart) == RESOURCE_BANG;
       }
 
+   /*!
+    * Walk the fields of message in order, decoding each field's header once
+    * and checking it against the size of the body, so a malformed message
+    * ends the walk (see isMalformed) instead of being read past its end.
+    */
+   TFieldCursor::TFieldCursor
+      (
+      TMsg &message
+      )
+      {
+      _start = message.getBody();
+      _end = message.getBodySize();
+      if(_end > MESSAGE_BODY_MEM_SIZE)
+         _end = MESSAGE_BODY_MEM_SIZE;
+      _offset = 0;
+      _malformed = FALSE;
+      decode();
+      }
+
+      TVoid
+   TFieldCursor::decode()
+      {
+      _onField = FALSE;
+      if(_offset >= _end)
+         return;
+      if(_end - _offset < sizeof(_key) + sizeof(_length))
+         {
+         _malformed = TRUE;
+         return;
+         }
+      memcpy(&_key, _start + _offset, sizeof(_key));
+      memcpy(&_length, _start + _offset + sizeof(_key), sizeof(_length));
+      if(_length > _end - _offset - sizeof(_key) - sizeof(_length))
+         {
+         _malformed = TRUE;
+         return;
+         }
+      if(_key > NO_MORE_RESOURCES)
+         _key = NOT_A_RESOURCE;
+      _onField = TRUE;
+      }
+
+      TBoolean
+   TFieldCursor::valid()
+      {
+      return _onField;
+      }
+
+      TVoid
+   TFieldCursor::next()
+      {
+      if(!_onField)
+         return;
+      _offset += sizeof(_key) + sizeof(_length) + _length;
+      decode();
+      }
+
+      TResourceKey
+   TFieldCursor::key()
+      {
+      return _key;
+      }
+
+      TResourceType
+   TFieldCursor::type()
+      {
+      return getResourceType(_key);
+      }
+
+      TBoolean
+   TFieldCursor::isBang()
+      {
+      return _onField && _key == RESOURCE_BANG;
+      }
+
+      Tnc8*
+   TFieldCursor::value()
+      {
+      return _start + _offset + sizeof(_key) + sizeof(_length);
+      }
+
+      size_t
+   TFieldCursor::length()
+      {
+      return _length;
+      }
+
+      size_t
+   TFieldCursor::offset()
+      {
+      return _offset;
+      }
+
+      TBoolean
+   TFieldCursor::isMalformed()
+      {
+      return _malformed;
+      }
+
+   /*!
+    * @return The position of this message within a table transfer, or -1 if
+    * it is not part of one.
+    */
+      ssize_t
+   TMsg::getStreamSequence()
+      {
+      TStreamHeader header;
+      if(getResourceKey(0) != RESOURCE_STREAM || getFieldSize(0) != sizeof(header))
+         return -1;
+      memcpy(&header, getFieldPointer(0), sizeof(header));
+      return header.sequence;
+      }
+
+      TBoolean
+   TMsg::isStreamEnd()
+      {
+      TStreamHeader header;
+      if(getResourceKey(0) != RESOURCE_STREAM || getFieldSize(0) != sizeof(header))
+         return FALSE;
+      memcpy(&header, getFieldPointer(0), sizeof(header));
+      return header.last;
+      }
+
       TBoolean
    TMsg::isValid()
       {
@@ -744,453 +1699,3556 @@ namespace msg
       }
 
    /*!
-    * Create a one-to-one mapping of keys to names.
-    * The current approach is to use hashing.
+    * Unmap an attachment, on either side, once done with it.
     */
-      static TAgentKey
-   computeAgentKey
+      TVoid
+   releaseAttachment
       (
-      Tnc8 *name
+      const TVoid *attachment,
+      size_t length
       )
       {
-      TAgentKey agentKey = (TAgentKey)hash::compute(name, ' ', 'z');
-      if(agent_names.count(agentKey) == 0)
-         {
-         //MESSAGING_LOG_ERROR("The name \"%s\" does not name an agent. Forget to call msg::initialize?", name);
-         agentKey = NOT_AN_AGENT;
-         }
-      else while(agent_names.count(agentKey) > 0 &&
-            agent_names[agentKey].compare(name) != 0) // chain if there's a collision
-         {
-         (size_t)agentKey++;
-         }
-
-      //MESSAGING_LOG_INFO("%s => %u", name, agentKey);
-
-      return agentKey;
+      munmap((Tn8 *)attachment - ATTACHMENT_OFFSET, ATTACHMENT_OFFSET + length);
       }
 
    /*!
-    * Create a one-to-one mapping of keys to names.
-    * The current approach is to use hashing.
+    * Add delta to the holds on each attachment of message (see
+    * TAttachmentHeader), removing any segment left with none. Holds are only
+    * added to segments that still have some, since one with none may already
+    * be going.
+    * @param unmapped Only the attachments message has not had mapped.
+    * @return FALSE if an attachment is gone.
     */
-      static TResourceKey
-   computeResourceKey
+      static TBoolean
+   holdAttachments
       (
-      Tnc8 *name
+      TMsg *message,
+      Ts32 delta,
+      TBoolean unmapped
       )
       {
-      //The key we will 'compute'
-      TResourceKey resourceKey;
-      if(strcmp(name, "resourceName") == 0)
-         {
-         resourceKey = hash::getMaxKey()+1;
-         }
-      else if(strcmp(name, "noMoreResources") == 0)
-         {
-         resourceKey = hash::getMaxKey()+2;
-         }
-      else
+      TBoolean held = TRUE;
+      for(ssize_t iBody = 0; iBody >= 0 && (size_t)iBody < message->getBodySize(); iBody = message->getNextFieldOffset(iBody))
          {
-         resourceKey = (TAgentKey)hash::compute(name, ' ', 'z');
-         if(resource_names.count(resourceKey) == 0)
+         TAttachment attachment;
+         if(message->getResourceKey(iBody) != RESOURCE_ATTACHMENT || message->getFieldSize(iBody) != sizeof(attachment))
+            continue;
+         memcpy(&attachment, message->getFieldPointer(iBody), sizeof(attachment));
+         if(unmapped && attachment.mapped)
+            continue;
+         if(delta > 0 && attachment.mapped)
             {
-            //MESSAGING_LOG_ERROR("The name \"%s\" does not name a resource. Forget to call msg::initialize?", name);
-            resourceKey = NOT_A_RESOURCE;
+            // a fresh copy is the next recipient's to map
+            attachment.mapped = FALSE;
+            memcpy((Tn8 *)message->getFieldPointer(iBody), &attachment, sizeof(attachment));
             }
-         else while(resource_names.count(resourceKey) > 0 &&
-               resource_names[resourceKey].compare(name) != 0) // chain if there's a collision
+
+         attachment.name[sizeof(attachment.name) - 1] = '\0';
+         int fd = shm_open(attachment.name, O_RDWR, 0);
+         TVoid *p = fd == -1 ? MAP_FAILED : mmap(NULL, sizeof(TAttachmentHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+         if(fd != -1)
+            close(fd);
+         if(MAP_FAILED == p)
             {
-            (size_t)resourceKey++;
+            MESSAGING_LOG_ERROR("Attachment '%s' is gone", attachment.name);
+            held = FALSE;
+            continue;
+            }
+         volatile Ts32 *refs = &((TAttachmentHeader *)p)->refs;
+         Ts32 old;
+         do
+            {
+            old = *refs;
             }
+         while(old > 0 && !__sync_bool_compare_and_swap(refs, old, old + delta));
+         if(old <= 0)
+            held = FALSE;
+         else if(old + delta == 0)
+            shm_unlink(attachment.name);
+         munmap(p, sizeof(TAttachmentHeader));
          }
-
-      //MESSAGING_LOG_INFO("%s => %u", name, resourceKey);
-      return resourceKey;
+      return held;
       }
 
-      static Ts32
-   getSettableBits
+      static TBoolean
+   hasAttachments
       (
-      Ts32 mq_flags
+      TMsg *message
       )
       {
-      return mq_flags && O_NONBLOCK;
+      for(ssize_t iBody = 0; iBody >= 0 && (size_t)iBody < message->getBodySize(); iBody = message->getNextFieldOffset(iBody))
+         if(message->getResourceKey(iBody) == RESOURCE_ATTACHMENT)
+            return TRUE;
+      return FALSE;
+      }
+
+   /*!
+    * Let go of the sender's hold on the attachments of message, once it has
+    * been sent to all it is for, or has failed to be.
+    */
+      TVoid
+   TMsg::releaseAttachments()
+      {
+      holdAttachments(this, -1, FALSE);
       }
 
+   /*!
+    * Give the nodes of received back to received_spare, letting go of the
+    * holds of messages on attachments they never had mapped.
+    */
       static TVoid
-   getMaxAttributes
+   recycleReceived
       (
-      mq_attr *attr
+      std::list<TMsg> &received,
+      std::list<TMsg>::iterator first,
+      std::list<TMsg>::iterator last
       )
       {
-      Tn8 buffer[16];
-      /* fail-safe maximums */
-      attr->mq_maxmsg = 5;
-      attr->mq_msgsize = 4096;
-      /* user-specified maximums */
-      if(SUCCESS != file::getContents("/proc/sys/fs/mqueue/msg_max", buffer, sizeof(buffer)))
-         {
-         MESSAGING_LOG_ERROR("Failure to read from /proc/sys/fs/mqueue/msg_max");
-         }
-      else if(EOF == sscanf(buffer, "%lu", &(attr->mq_maxmsg)))
-         {
-         MESSAGING_LOG_ERROR("Failure to parse msg_max");
-         }
-      if(SUCCESS != file::getContents("/proc/sys/fs/mqueue/msgsize_max", buffer, sizeof(buffer)))
-         {
-         MESSAGING_LOG_ERROR("Failure to read from /proc/sys/fs/mqueue/msgsize_max");
-         }
-      else if(EOF == sscanf(buffer, "%lu", &(attr->mq_msgsize)))
-         {
-         MESSAGING_LOG_ERROR("Failure to parse msgsize_max");
-         }
+      for(std::list<TMsg>::iterator it = first; it != last; it++)
+         holdAttachments(&*it, -1, TRUE);
+      received_spare.splice(received_spare.end(), received, first, last);
       }
 
-      TVoid
-   initialize()
+   /*!
+    * Whether key names an agent, here or in the shared registry.
+    */
+      static TBoolean
+   isKnownAgent
+      (
+      TAgentKey key
+      )
       {
-      initialize(NULL);
+      lockNames();
+      TBoolean known = agent_names.count(key) > 0;
+      unlockNames();
+      if(known)
+         return TRUE;
+      std::string name;
+      if(!registry::find(registry::AGENTS, key, &name, NULL))
+         return FALSE;
+      lockNames();
+      agent_names.insert(std::make_pair(key, name));
+      unlockNames();
+      return TRUE;
       }
 
-      TVoid
-   initialize
+      static TBoolean
+   isKnownResource
       (
-      Tnc8 *configfile,
-      TBoolean doRep
+      TResourceKey key
       )
       {
-      if(!initialized)
-         {
-         initialized = TRUE;
-         Tn8 line[128];
+      lockNames();
+      TBoolean known = resource_names.count(key) > 0;
+      unlockNames();
+      if(known)
+         return TRUE;
+      std::string name;
+      Ts32 type;
+      if(!registry::find(registry::RESOURCES, key, &name, &type))
+         return FALSE;
+      lockNames();
+      if(resource_names.insert(std::make_pair(key, name)).second)
+         resource_types[key] = (TResourceType)type;
+      unlockNames();
+      return TRUE;
+      }
 
-         g_doRep = doRep;
+   /*!
+    * Register an agent in the shared registry, or just here if there is none.
+    */
+      static TAgentKey
+   enrollAgent
+      (
+      Tnc8 *name
+      )
+      {
+      TAgentKey agentKey = (TAgentKey)hash::compute(name, ' ', 'z');
+      if(registry::isAttached())
+         {
+         size_t key = registry::enroll(registry::AGENTS, name, 0, agentKey);
+         if(key == registry::NOT_FOUND)
+            return NOT_AN_AGENT;
+         agentKey = (TAgentKey)key;
+         }
+      lockNames();
+      if(!registry::isAttached())
+         {
+         while(agent_names.count(agentKey) > 0 &&
+               agent_names[agentKey].compare(name) != 0) // chain if there's a collision
+            {
+            (size_t)agentKey++;
+            }
+         }
+      if(agent_names.insert(std::make_pair(agentKey, std::string(name))).second)
+         names_version++;
+      unlockNames();
+      return agentKey;
+      }
 
-         if(configfile == NULL)
+      static TResourceKey
+   enrollResource
+      (
+      Tnc8 *name,
+      TResourceType type
+      )
+      {
+      TResourceKey resourceKey = (TResourceKey)hash::compute(name, ' ', 'z');
+      if(registry::isAttached())
+         {
+         size_t key = registry::enroll(registry::RESOURCES, name, type, resourceKey);
+         if(key == registry::NOT_FOUND)
+            return NOT_A_RESOURCE;
+         resourceKey = (TResourceKey)key;
+         // whoever registered it first decided its type
+         registry::find(registry::RESOURCES, resourceKey, NULL, (Ts32 *)&type);
+         }
+      lockNames();
+      if(!registry::isAttached())
+         {
+         while(resource_names.count(resourceKey) > 0 &&
+               resource_names[resourceKey].compare(name) != 0) // chain if there's a collision
             {
-            configfile = CONFIG_FILE;
+            (size_t)resourceKey++;
+            }
+         }
+      if(resource_names.insert(std::make_pair(resourceKey, std::string(name))).second)
+         names_version++;
+      resource_types[resourceKey] = type;
+      unlockNames();
+      return resourceKey;
+      }
+
+   /*!
+    * Create a one-to-one mapping of keys to names.
+    * The current approach is to use hashing; see also msg::registry.
+    */
+      static TAgentKey
+   computeAgentKey
+      (
+      Tnc8 *name
+      )
+      {
+      TAgentKey agentKey = (TAgentKey)hash::compute(name, ' ', 'z');
+      if(registry::isAttached())
+         {
+         size_t key = registry::lookup(registry::AGENTS, name, agentKey);
+         if(key == registry::NOT_FOUND)
+            return NOT_AN_AGENT;
+         agentKey = (TAgentKey)key;
+         lockNames();
+         agent_names.insert(std::make_pair(agentKey, std::string(name)));
+         unlockNames();
+         }
+      else
+         {
+         lockNames();
+         if(agent_names.count(agentKey) == 0)
+            {
+            //MESSAGING_LOG_ERROR("The name \"%s\" does not name an agent. Forget to call msg::initialize?", name);
+            agentKey = NOT_AN_AGENT;
+            }
+         else while(agent_names.count(agentKey) > 0 &&
+               agent_names[agentKey].compare(name) != 0) // chain if there's a collision
+            {
+            (size_t)agentKey++;
             }
+         unlockNames();
+         }
+
+      //MESSAGING_LOG_INFO("%s => %u", name, agentKey);
 
-         FILE *fp = fopen(configfile, "rb");
+      return agentKey;
+      }
 
-         if(fp)
+   /*!
+    * Create a one-to-one mapping of keys to names.
+    * The current approach is to use hashing; see also msg::registry.
+    */
+      static TResourceKey
+   computeResourceKey
+      (
+      Tnc8 *name
+      )
+      {
+      //The key we will 'compute'
+      TResourceKey resourceKey;
+      if(strcmp(name, "resourceName") == 0)
+         {
+         resourceKey = hash::getMaxKey()+1;
+         }
+      else if(strcmp(name, "noMoreResources") == 0)
+         {
+         resourceKey = hash::getMaxKey()+2;
+         }
+      else
+         {
+         resourceKey = (TAgentKey)hash::compute(name, ' ', 'z');
+         if(registry::isAttached())
             {
-            while(fgets(line, sizeof(line), fp))
+            size_t key = registry::lookup(registry::RESOURCES, name, resourceKey);
+            if(key == registry::NOT_FOUND)
+               return NOT_A_RESOURCE;
+            resourceKey = (TResourceKey)key;
+            isKnownResource(resourceKey);
+            }
+         else
+            {
+            lockNames();
+            if(resource_names.count(resourceKey) == 0)
+               {
+               //MESSAGING_LOG_ERROR("The name \"%s\" does not name a resource. Forget to call msg::initialize?", name);
+               resourceKey = NOT_A_RESOURCE;
+               }
+            else while(resource_names.count(resourceKey) > 0 &&
+                  resource_names[resourceKey].compare(name) != 0) // chain if there's a collision
                {
-               Tnc8 *delim = " \n";
+               (size_t)resourceKey++;
+               }
+            unlockNames();
+            }
+         }
 
-               //MESSAGING_LOG_INFO("line: %s", line);
+      //MESSAGING_LOG_INFO("%s => %u", name, resourceKey);
+      return resourceKey;
+      }
 
-               /* get name of agent or resource */
-               Tn8 *tok = strtok(line, delim);
-               if('/' == line[0])
-                  {
-                  TAgentKey agentKey = (TAgentKey)hash::compute(tok, ' ', 'z');
-                  while(agent_names.count(agentKey) > 0 &&
-                        agent_names[agentKey].compare(tok) != 0) // chain if there's a collision
-                     {
-                     (size_t)agentKey++;
-                     }
-                  //MESSAGING_LOG_INFO("create agent %s", tok);
-                  agent_names[agentKey] = tok;
-                  }
-               else
-                  {
-                  TResourceKey resourceKey = (TResourceKey)hash::compute(tok, ' ', 'z');
-                  while(resource_names.count(resourceKey) > 0 &&
-                        resource_names[resourceKey].compare(tok) != 0) // chain if there's a collision
-                     {
-                     (size_t)resourceKey++;
-                     }
-                  if(FALSE && strstr(tok, "ipPort"))
-                     MESSAGING_LOG_INFO("Created resource \"%s\" <==> %u", tok, resourceKey);
-                  resource_names[resourceKey] = tok;
-                  /* get ASN type of resource */
-                  tok = strtok(NULL, delim);
-
-                  resource_types[resourceKey] = parseResourceType(tok);
-                  }
+      static Ts32
+   getSettableBits
+      (
+      Ts32 mq_flags
+      )
+      {
+      return mq_flags && O_NONBLOCK;
+      }
 
+      static TVoid
+   getMaxAttributes
+      (
+      mq_attr *attr
+      )
+      {
+      Tn8 buffer[16];
+      /* fail-safe maximums */
+      attr->mq_maxmsg = 5;
+      attr->mq_msgsize = 4096;
+      /* user-specified maximums */
+      if(SUCCESS != file::getContents("/proc/sys/fs/mqueue/msg_max", buffer, sizeof(buffer)))
+         {
+         MESSAGING_LOG_ERROR("Failure to read from /proc/sys/fs/mqueue/msg_max");
+         }
+      else if(EOF == sscanf(buffer, "%lu", &(attr->mq_maxmsg)))
+         {
+         MESSAGING_LOG_ERROR("Failure to parse msg_max");
+         }
+      if(SUCCESS != file::getContents("/proc/sys/fs/mqueue/msgsize_max", buffer, sizeof(buffer)))
+         {
+         MESSAGING_LOG_ERROR("Failure to read from /proc/sys/fs/mqueue/msgsize_max");
+         }
+      else if(EOF == sscanf(buffer, "%lu", &(attr->mq_msgsize)))
+         {
+         MESSAGING_LOG_ERROR("Failure to parse msgsize_max");
+         }
+      }
 
-               }
+   /*!
+    * Register every agent and resource in configfile that is not already.
+    * @return The number of names that are new.
+    */
+      static Ts32
+   loadNames
+      (
+      Tnc8 *configfile
+      )
+      {
+      Tn8 line[128];
+      FILE *fp = fopen(configfile, "rb");
+
+      if(!fp)
+         {
+         MESSAGING_LOG_ERROR("Cannot open \"%s\"", configfile);
+         return -1;
+         }
+
+      size_t before = names_version;
+      while(fgets(line, sizeof(line), fp))
+         {
+         Tnc8 *delim = " \n";
+
+         //MESSAGING_LOG_INFO("line: %s", line);
+
+         /* get name of agent or resource */
+         Tn8 *tok = strtok(line, delim);
+         if(tok == NULL)
+            continue;
+         if('/' == line[0])
+            {
+            //MESSAGING_LOG_INFO("create agent %s", tok);
+            enrollAgent(tok);
             }
          else
             {
-            MESSAGING_LOG_ERROR("Cannot open \"%s\"", configfile);
+            Tnc8 *name = tok;
+            /* get ASN type of resource */
+            tok = strtok(NULL, delim);
+
+            enrollResource(name, parseResourceType(tok));
+            }
+         }
+      fclose(fp);
+      return names_version - before;
+      }
+
+      TVoid
+   initialize()
+      {
+      initialize(NULL);
+      }
+
+      TVoid
+   initialize
+      (
+      Tnc8 *configfile,
+      TBoolean doRep
+      )
+      {
+      if(!initialized)
+         {
+         initialized = TRUE;
+
+         g_doRep = doRep;
+
+         if(configfile == NULL)
+            {
+            configfile = CONFIG_FILE;
+            }
+         config_path = configfile;
+
+         // names.conf only seeds the shared registry; without one keys are
+         // computed as before, privately. DUMBWAITER_NAME_REGISTRY names
+         // another registry, e.g. one of a test's own, or if empty none.
+         Tnc8 *registryName = getenv("DUMBWAITER_NAME_REGISTRY");
+         if(registryName == NULL)
+            registryName = NAME_REGISTRY;
+         if(*registryName == '\0')
+            MESSAGING_LOG_INFO("Names are private to this process");
+         else if(!registry::attach(registryName, hash::getMaxKey()))
+            MESSAGING_LOG_ERROR("No shared name registry, names are private to this process");
+
+         loadNames(configfile);
+
+         // e.g. for CI: every agent in one thread, on the simulated
+         // transport with this seed and no delays or faults
+         Tnc8 *seed = getenv("DUMBWAITER_SIMULATE");
+         if(seed && *seed)
+            {
+            TSimulation sim;
+            memset(&sim, 0, sizeof(sim));
+            sim.seed = strtoul(seed, NULL, 0);
+            simulate(&sim);
+            }
+         }
+      }
+
+   /*!
+    * Pick up names added to names.conf since initialize. Names are only ever
+    * added, never changed or removed, so a key once looked up stays good. May
+    * run in a thread of its own while others look names up.
+    * @param configpath The file to read, by default the one we were
+    * initialized with.
+    * @return The number of names that are new.
+    * @retval -1 The file cannot be read.
+    */
+      Ts32
+   reloadNames
+      (
+      Tnc8 *configpath
+      )
+      {
+      if(configpath == NULL)
+         configpath = config_path.c_str();
+      Ts32 added = loadNames(configpath);
+      if(added > 0)
+         MESSAGING_LOG_INFO("%d new names in \"%s\", now at version %u", added, configpath, getNamesVersion());
+      return added;
+      }
+
+   /*!
+    * The number of names registered so far, here or host-wide; it only grows.
+    */
+      size_t
+   getNamesVersion()
+      {
+      return registry::isAttached() ? registry::getVersion() : names_version;
+      }
+
+   /*!
+    * Watch names.conf for changes, see checkNames.
+    * @return A descriptor to poll for POLLIN along with any others.
+    * @retval -1 Error
+    */
+      Ts32
+   watchNames()
+      {
+      if(names_watch != -1)
+         return names_watch;
+      // watch the directory rather than the file, since editors tend to
+      // replace the file rather than write to it
+      std::string::size_type slash = config_path.rfind('/');
+      std::string directory = slash == std::string::npos ? "." : config_path.substr(0, slash + 1);
+      names_watch = inotify_init1(IN_NONBLOCK);
+      if(-1 == names_watch ||
+            -1 == inotify_add_watch(names_watch, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO))
+         {
+         MESSAGING_LOG_POSIX_ERROR;
+         if(-1 != names_watch)
+            close(names_watch);
+         names_watch = -1;
+         }
+      return names_watch;
+      }
+
+   /*!
+    * Reload names.conf if it has changed since last we looked. Does not block.
+    * @return The number of names that are new.
+    */
+      Ts32
+   checkNames()
+      {
+      if(-1 == names_watch)
+         return 0;
+      std::string::size_type slash = config_path.rfind('/');
+      std::string file = slash == std::string::npos ? config_path : config_path.substr(slash + 1);
+      TBoolean changed = FALSE;
+      Tn8 events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+      ssize_t length;
+      while((length = read(names_watch, events, sizeof(events))) > 0)
+         {
+         for(Tn8 *p = events; p < events + length; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+            {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if(event->len && file.compare(event->name) == 0)
+               changed = TRUE;
             }
          }
+      return changed ? reloadNames(NULL) : 0;
+      }
+
+   /*!
+    * The simulated transport, see simulate: every agent is a list in this
+    * process, and messages in flight reach it once virtual time passes the
+    * time they are due, in order of due time and then of sending.
+    */
+   static TBoolean g_simulating = FALSE;
+   static TSimulation g_sim;
+   static Ts64 sim_now_us = 0;
+   static Tu32 sim_random = 1;
+   static size_t sim_sequence = 0;
+   static int sim_mqd = 0;
+   typedef std::pair<Ts64, size_t> TSimDue;
+   static std::map<TSimDue, std::pair<TAgentKey, TMsg> > sim_in_flight;
+   static std::map<TAgentKey, std::list<TMsg> > sim_queues;
+   static std::map<TAgentKey, size_t> sim_pending;
+   static std::map<TAgentKey, Ts64> sim_last_due;
+
+      static Tu32
+   simRandom()
+      {
+      // xorshift32, so that a seed gives the same run everywhere
+      sim_random ^= sim_random << 13;
+      sim_random ^= sim_random >> 17;
+      sim_random ^= sim_random << 5;
+      return sim_random;
+      }
+
+      static TBoolean
+   simChance
+      (
+      Tu32 percent
+      )
+      {
+      return percent > 0 && simRandom() % 100 < percent;
+      }
+
+   /*!
+    * Run every agent created from now on in this thread, on the simulated
+    * transport, instead of on POSIX queues, or go back to them if sim is
+    * NULL. Sends are never blocked: a full queue is SEND_FULL. Time only
+    * passes with advance, runSimulation or a blocking receive, so the same
+    * seed and the same calls give the same run.
+    */
+      TVoid
+   simulate
+      (
+      const TSimulation *sim
+      )
+      {
+      sim_in_flight.clear();
+      sim_queues.clear();
+      sim_pending.clear();
+      sim_last_due.clear();
+      sim_now_us = 0;
+      sim_sequence = 0;
+      // timers were set by the other clock
+      for(std::map<size_t, TScheduled *>::iterator it = scheduled.begin(); it != scheduled.end(); it++)
+         delete it->second;
+      scheduled.clear();
+      timer_wheel_ready = FALSE;
+      retry_cache.clear();
+      commit_timers.clear();
+      held_timers.clear();
+      flush_timer_pending = FALSE;
+      g_simulating = sim != NULL;
+      if(!sim)
+         return;
+      g_sim = *sim;
+      sim_random = sim->seed ? sim->seed : 1;
+      }
+
+      Ts64
+   getVirtualTime()
+      {
+      return sim_now_us;
+      }
+
+      static TSendResult
+   simDeliver
+      (
+      TMsg *message,
+      TAgentKey via
+      )
+      {
+      size_t capacity = g_sim.capacity ? g_sim.capacity : msg::attribute_cache[via].mq_maxmsg;
+      if(sim_queues[via].size() + sim_pending[via] >= capacity || simChance(g_sim.fullPercent))
+         return SEND_FULL;
+
+      Ts64 due = sim_now_us + g_sim.minDelayUs;
+      if(g_sim.maxDelayUs > g_sim.minDelayUs)
+         due += simRandom() % (g_sim.maxDelayUs - g_sim.minDelayUs + 1);
+      // unless reordered, a message waits for those sent before it
+      Ts64 &last = sim_last_due[via];
+      if(due < last && !simChance(g_sim.reorderPercent))
+         due = last;
+      if(due > last)
+         last = due;
+
+      sim_in_flight.insert(std::make_pair(TSimDue(due, sim_sequence++), std::make_pair(via, *message)));
+      sim_pending[via]++;
+      return SEND_OK;
+      }
+
+      static TVoid
+   simDeliverNext()
+      {
+      std::map<TSimDue, std::pair<TAgentKey, TMsg> >::iterator next = sim_in_flight.begin();
+      if(next->first.first > sim_now_us)
+         sim_now_us = next->first.first;
+      TAgentKey via = next->second.first;
+      sim_queues[via].push_back(next->second.second);
+      sim_pending[via]--;
+      sim_in_flight.erase(next);
+      }
+
+   /*!
+    * Let us of virtual time pass, delivering whatever falls due.
+    * @return The number of messages delivered.
+    */
+      size_t
+   advance
+      (
+      Ts64 us
+      )
+      {
+      Ts64 until = sim_now_us + us;
+      size_t delivered = 0;
+      for(;;)
+         {
+         // timers go off in virtual time too, between deliveries
+         Ts64 timerWait = getNextTimer();
+         Ts64 timerDue = timerWait == -1 ? -1 : sim_now_us + timerWait;
+         TBoolean haveMessage = !sim_in_flight.empty() && sim_in_flight.begin()->first.first <= until;
+         if(timerDue != -1 && timerDue <= until
+               && (!haveMessage || timerDue <= sim_in_flight.begin()->first.first))
+            {
+            sim_now_us = timerDue;
+            runTimers();
+            }
+         else if(haveMessage)
+            {
+            simDeliverNext();
+            delivered++;
+            }
+         else
+            break;
+         }
+      sim_now_us = until;
+      return delivered;
+      }
+
+   /*!
+    * Let virtual time pass until nothing is in flight. Timers going off in
+    * the meantime are run; those due later are left for advance.
+    * @return The number of messages delivered.
+    */
+      size_t
+   runSimulation()
+      {
+      size_t delivered = 0;
+      while(!sim_in_flight.empty())
+         delivered += advance(sim_in_flight.begin()->first.first - sim_now_us);
+      return delivered;
+      }
+
+      static TMsg *
+   simReceive
+      (
+      TAgentKey key,
+      TBoolean blocking
+      )
+      {
+      std::list<TMsg> &queue = sim_queues[key];
+      // blocking in one thread means letting time pass until something
+      // comes, running timers as they fall due the way advance does
+      while(queue.empty() && blocking)
+         {
+         Ts64 timerWait = getNextTimer();
+         if(timerWait != -1
+               && (sim_in_flight.empty() || sim_now_us + timerWait <= sim_in_flight.begin()->first.first))
+            {
+            sim_now_us += timerWait;
+            runTimers();
+            }
+         else if(!sim_in_flight.empty())
+            simDeliverNext();
+         else
+            break;
+         }
+      if(queue.empty())
+         return NULL;
+      std::list<TMsg> &received = msg::received_cache[key];
+      received.splice(received.end(), queue, queue.begin());
+      return &received.back();
+      }
+
+   /*!
+    * Record every message agent receives to the capture file at path (see
+    * msg::capture), or stop if path is NULL.
+    */
+      Ts32
+   setCapture
+      (
+      TAgentKey agent,
+      Tnc8 *path
+      )
+      {
+      std::map<TAgentKey, int>::iterator it = capture_cache.find(agent);
+      if(it != capture_cache.end())
+         {
+         close(it->second);
+         capture_cache.erase(it);
+         }
+      if(path == NULL)
+         return SUCCESS;
+      int fd = capture::open(path);
+      if(-1 == fd)
+         return FAILURE;
+      capture_cache[agent] = fd;
+      return SUCCESS;
+      }
+
+   /*!
+    * Capture without changing any code: DUMBWAITER_CAPTURE names the file,
+    * and DUMBWAITER_CAPTURE_AGENTS, if set, the agents whose traffic goes in
+    * it, separated by commas.
+    */
+      static TVoid
+   captureFromEnvironment
+      (
+      TAgentKey agent,
+      Tnc8 *path
+      )
+      {
+      Tnc8 *file = getenv("DUMBWAITER_CAPTURE");
+      if(file == NULL || *file == '\0')
+         return;
+      Tnc8 *agents = getenv("DUMBWAITER_CAPTURE_AGENTS");
+      if(agents != NULL)
+         {
+         std::string list = std::string(",") + agents + ",";
+         if(list.find(std::string(",") + path + ",") == std::string::npos)
+            return;
+         }
+      setCapture(agent, file);
+      }
+
+      TAgentKey
+   createAgent
+      (
+      Tnc8 *path,
+      mq_attr *attr
+      )
+      {
+      mqd_t mqd = -1;
+      TBoolean created = FALSE;
+
+      MESSAGING_LOG_INFO("Allocating message queue at '%s'", path);
+      MESSAGING_LOG_INFO("Maximum number of messages for '%s': %ld", path, attr->mq_maxmsg);
+      MESSAGING_LOG_INFO("Maximum size of messages for '%s': %ld", path, attr->mq_msgsize);
+
+      attr->mq_flags |= O_EXCL | O_RDWR;
+      if(g_simulating)
+         {
+         mqd = sim_mqd++;
+         goto success;
+         }
+#ifndef SOLIPSISM
+      mqd = mq_open(path, attr->mq_flags | O_CREAT, S_IRUSR | S_IWUSR, attr);
+#else
+      mqd = solip_imqd++;
+#endif
+      if (-1 != mqd)
+         {
+         MESSAGING_LOG_INFO("Created new message queue");
+         created = TRUE;
+         goto success;
+         }
+      else if(EEXIST != errno)
+         {
+         MESSAGING_LOG_POSIX_ERROR;
+         return -1;
+         }
+
+#ifndef SOLIPSISM //Note: This code is unreachable with solipsism
+      mqd = mq_open(path, attr->mq_flags, S_IRUSR | S_IWUSR, attr);
+#endif
+      if(-1 != mqd)
+         MESSAGING_LOG_INFO("Used existing message queue");
+      else
+         {
+         MESSAGING_LOG_ERROR("Something dreadful happened!");
+         MESSAGING_LOG_POSIX_ERROR;
+         return -1;
+         }
+
+      success:
+      // an agent not in names.conf registers itself
+      TAgentKey key = enrollAgent(path);
+      if(key == NOT_AN_AGENT)
+         {
+         // e.g. the registry is full or the path too long for it
+         MESSAGING_LOG_ERROR("Cannot enroll '%s'", path);
+#ifndef SOLIPSISM
+         if(!g_simulating)
+            {
+            mq_close(mqd);
+            if(created)
+               mq_unlink(path);
+            }
+#endif
+         return -1;
+         }
+      //MESSAGING_LOG_INFO("key = %u", key);
+      msg::attribute_cache[key] = *attr;
+      msg::special_flags[key] = 0;
+      // enrollAgent has put the name in already, and it is never replaced
+      std::list<TAgentKey>::iterator opened = std::find(forward_opened.begin(), forward_opened.end(), key);
+      if(opened != forward_opened.end())
+         {
+         // opened by forward (see openForwarded), and ours from now on
+         mq_close(msg::descriptor_cache[key]);
+         forward_opened.erase(opened);
+         }
+      msg::descriptor_cache[key] = mqd;
+      msg::agent_key_cache[path] = key;
+      //MESSAGING_LOG_INFO("Success");
+      captureFromEnvironment(key, path);
+      return key;
+      }
+
+      TAgentKey
+   createAgent
+      (
+      Tnc8 *path,
+      size_t max_msg_count,
+      size_t max_msg_size, /* in bytes */
+      TBoolean blocking
+      )
+      {
+      mq_attr attr;
+      mq_attr max_attr;
+      attr.mq_maxmsg = max_msg_count;
+      attr.mq_msgsize = max_msg_size;
+      attr.mq_flags = 0;
+      if(!blocking)
+         {
+         attr.mq_flags |= O_NONBLOCK;
+         }
+
+      if(attr.mq_msgsize > MESSAGE_BODY_MEM_SIZE)
+         {
+         MESSAGING_LOG_ERROR("Argued body size (%ld) is larger than static memory allocation (%u).", attr.mq_msgsize, MESSAGE_BODY_MEM_SIZE);
+         return -1;
+         }
+
+      getMaxAttributes(&max_attr);
+      if(attr.mq_maxmsg <= max_attr.mq_maxmsg && attr.mq_msgsize <= max_attr.mq_msgsize)
+         return createAgent(path, &attr);
+      else
+         {
+         MESSAGING_LOG_ERROR("Argued value(s) larger than soft-maximum");
+         return -1;
+         }
+      }
+
+   /*!
+    * Create a new key and associated facility for sending/receiving messages.
+    *
+    * @return The key
+    * @retval -1 Error
+    */
+      TAgentKey
+   createAgent(Tnc8 *path)
+      {
+      mq_attr attr;
+
+      getMaxAttributes(&attr);
+      attr.mq_flags = 0;
+      return createAgent(path, &attr);
+      }
+
+      TAgentKey
+   getAgentKey
+      (
+      Tnc8 *path
+      )
+      {
+      std::map<string, TAgentKey>::iterator it = agent_key_cache.find(path);
+      if(it != agent_key_cache.end())
+         return it->second;
+      // not opened by us, but may still be reachable through a route
+      return computeAgentKey(path);
+      }
+
+   /*!
+    * Forget the messages taken from an agent's queue for fair queuing.
+    */
+      static TVoid
+   clearFair
+      (
+      TFairQueue &fair
+      )
+      {
+      std::map<TAgentKey, TSenderQueue>::iterator it;
+      for(it = fair.senders.begin(); it != fair.senders.end(); it++)
+         {
+         recycleReceived(it->second.messages, it->second.messages.begin(), it->second.messages.end());
+         it->second.deficit = 0;
+         }
+      fair.active.clear();
+      fair.count = 0;
+      fair.credited = FALSE;
+      }
+
+   /*!
+    * Throw away whatever is in mqd, without waiting.
+    * @return The number of messages thrown away.
+    */
+      static size_t
+   drainQueue
+      (
+      TAgentKey key,
+      mqd_t mqd
+      )
+      {
+      size_t count = 0;
+#ifndef SOLIPSISM
+      TMsg message;
+      struct timespec past;
+      past.tv_sec = 0;
+      past.tv_nsec = 0;
+      while(mq_timedreceive(mqd, (char *)&message, msg::attribute_cache[key].mq_msgsize, NULL, &past) > 0)
+         {
+         holdAttachments(&message, -1, TRUE);
+         count++;
+         }
+#endif
+      return count;
+      }
+
+      static size_t
+   drainSimulated
+      (
+      TAgentKey key
+      )
+      {
+      std::list<TMsg> &queue = sim_queues[key];
+      size_t count = queue.size();
+      for(std::list<TMsg>::iterator it = queue.begin(); it != queue.end(); it++)
+         holdAttachments(&*it, -1, TRUE);
+      queue.clear();
+      // what is in flight would be in the queue already on the real transport
+      std::map<TSimDue, std::pair<TAgentKey, TMsg> >::iterator flying = sim_in_flight.begin();
+      while(flying != sim_in_flight.end())
+         {
+         if(flying->second.first == key)
+            {
+            holdAttachments(&flying->second.second, -1, TRUE);
+            sim_in_flight.erase(flying++);
+            count++;
+            }
+         else
+            flying++;
+         }
+      sim_pending.erase(key);
+      sim_last_due.erase(key);
+      return count;
+      }
+
+      Ts32
+   destroyAgent(Tnc8 *agentName)
+      {
+      TAgentKey key = computeAgentKey(agentName);
+      if(!g_simulating)
+         {
+         // sub-queues are numbered from 0, whichever process made them
+         if(partition_cache.count(key))
+            {
+            std::vector<mqd_t> &queues = partition_cache[key].queues;
+            for(size_t i = 0; i < queues.size(); i++)
+               drainQueue(key, queues[i]);
+            }
+         for(unsigned i = 0; ; i++)
+            {
+            Tn8 path[L_FIELD_MAX];
+            snprintf(path, sizeof(path), "%s.%u", agentName, i);
+            if(mq_unlink(path) != 0)
+               break;
+            }
+         }
+      setPartitions(key, 1, NOT_A_RESOURCE);
+      setCapture(key, NULL);
+      if(g_simulating)
+         {
+         // nothing sent to it before may turn up for an agent of the same name
+         drainSimulated(key);
+         sim_queues.erase(key);
+         }
+      else
+         {
+         // what is still queued goes with the queue, so let go of its attachments
+         if(msg::descriptor_cache.count(key))
+            drainQueue(key, msg::descriptor_cache[key]);
+         if(msg::descriptor_cache.count(key) && mq_close(msg::descriptor_cache[key]) != 0)
+            return FAILURE;
+         if(mq_unlink(agentName) != 0)
+            return FAILURE;
+         }
+      msg::attribute_cache.erase(key);
+      msg::special_flags.erase(key);
+      recycleReceived(msg::received_cache[key], msg::received_cache[key].begin(), msg::received_cache[key].end());
+      msg::received_cache.erase(key);
+      // the name stays, as getPath may have handed it out to another thread
+      msg::descriptor_cache.erase(key);
+      msg::held_cache.erase(key);
+      forward_opened.remove(key);
+      if(fair_cache.count(key))
+         {
+         clearFair(fair_cache[key]);
+         fair_cache.erase(key);
+         }
+      setRetry(key, NULL);
+      return SUCCESS;
+      }
+
+      TResourceKey
+   createResource(Tnc8 *name)
+      {
+      TResourceKey key = computeResourceKey(name);
+      resource_key_cache[name] = key;
+      return key;
+      }
+
+   /*!
+    * Like createResource(name), but registers the resource if no one has,
+    * for every process to see.
+    */
+      TResourceKey
+   createResource
+      (
+      Tnc8 *name,
+      TResourceType type
+      )
+      {
+      TResourceKey key = computeResourceKey(name);
+      if(key == NOT_A_RESOURCE)
+         key = enrollResource(name, type);
+      if(key != NOT_A_RESOURCE)
+         resource_key_cache[name] = key;
+      return key;
+      }
+
+      TResourceKey
+   getResourceKey(Tnc8 *name)
+      {
+      return msg::resource_key_cache[name];
+      }
+
+   /*!
+    * Names are never removed or replaced, so the name returned stays good
+    * however long it is kept, whatever other threads do meanwhile.
+    * @return "" for a key without a name.
+    */
+      Tnc8*
+   getResourceName
+      (
+      TResourceKey key
+      )
+      {
+      isKnownResource(key);
+      lockNames();
+      std::map<TResourceKey, std::string>::iterator it = resource_names.find(key);
+      Tnc8 *name = it != resource_names.end() ? it->second.c_str() : "";
+      unlockNames();
+      return name;
+      }
+
+      static Ts64
+   nowUs()
+      {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      return (Ts64)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+      }
+
+   /*!
+    * Time as timers see it: virtual while simulating, see simulate.
+    */
+      static Ts64
+   timerNowUs()
+      {
+      return g_simulating ? sim_now_us : nowUs();
+      }
+
+      static TMsg *
+   receiveFrom
+      (
+      TAgentKey key,
+      mqd_t mqd,
+      timespec* pTimeout
+      )
+      {
+      if(g_simulating)
+         return simReceive(key, pTimeout == NULL);
+      else
+         {
+         unsigned int priority;
+         // receive straight into a node of the cache, reusing a flushed one
+         std::list<TMsg> &received = msg::received_cache[key];
+         if(received_spare.empty())
+            received_spare.push_back(TMsg());
+         received.splice(received.end(), received_spare, received_spare.begin());
+         TMsg &message = received.back();
+         //MESSAGING_LOG_INFO("Attempting to receive message for %s", msg::agent_names[key].c_str());
+#ifndef SOLIPSISM
+         Ts32 mq_result;
+         if(pTimeout)
+            {
+            mq_result = mq_timedreceive (
+                  mqd,
+                  (char*)&message,
+                  msg::attribute_cache[key].mq_msgsize,
+                  &priority,
+                  pTimeout);
+            }
+         else
+            {
+            mq_result = mq_receive (
+                  mqd,
+                  (char*)&message,
+                  msg::attribute_cache[key].mq_msgsize,
+                  &priority);
+            }
+         if(-1 == mq_result)
+            {
+            if(errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT)
+               {
+               MESSAGING_LOG_POSIX_ERROR;
+               }
+            // the node may hold a message already received, so it must not
+            // be returned as new
+            received_spare.splice(received_spare.begin(), received, --received.end());
+            return NULL;
+            }
+         // everything else trusts the body size, so it has to be what came
+         size_t headerSize = sizeof(TMsg) - MESSAGE_BODY_MEM_SIZE;
+         if((size_t)mq_result < headerSize || message.getBodySize() != (size_t)mq_result - headerSize)
+            {
+            MESSAGING_LOG_ERROR("Dropped a message claiming %u bytes of body in %d bytes", (unsigned)message.getBodySize(), mq_result);
+            received_spare.splice(received_spare.begin(), received, --received.end());
+            return NULL;
+            }
+         std::map<TAgentKey, int>::iterator captured = capture_cache.find(key);
+         if(captured != capture_cache.end() && mq_result > 0)
+            capture::record(captured->second, &message, mq_result);
+//         MESSAGING_LOG_INFO("Receiving message for '%s'", agent_names[key].c_str());
+#endif
+         MESSAGING_LOG_INFO("Received message: '%s' ===> '%s'", getPath(message.getSender()), getPath(key));
+         return &message;
+         }
+      MESSAGING_LOG_ERROR("Invalid key");
+      return NULL;
+      }
+
+      static TVoid
+   refill
+      (
+      TSenderQueue &sender,
+      Ts64 now
+      )
+      {
+      if(sender.perSecond == 0)
+         return;
+      sender.tokens += (now - sender.refilledUs) * (Ts64)sender.perSecond;
+      sender.refilledUs = now;
+      if(sender.tokens > (Ts64)sender.burst * 1000000)
+         sender.tokens = (Ts64)sender.burst * 1000000;
+      }
+
+   /*!
+    * Move the message receiveFrom just took for key to its sender's queue.
+    */
+      static TVoid
+   enqueueFair
+      (
+      TAgentKey key,
+      TFairQueue &fair
+      )
+      {
+      std::list<TMsg> &received = msg::received_cache[key];
+      TAgentKey from = received.back().getSender();
+      TSenderQueue &sender = fair.senders[from];
+      // a sender over its limit has its excess dropped rather than let it
+      // fill the buffer in turn: it may have burst waiting on top of what
+      // its tokens already let through
+      if(sender.perSecond)
+         refill(sender, timerNowUs());
+      if(sender.perSecond && (Ts64)sender.messages.size() >= (Ts64)sender.burst + sender.tokens / 1000000)
+         {
+         MESSAGING_LOG_ERROR("Dropped message from '%s' over its limit", getPath(from));
+         recycleReceived(received, --received.end(), received.end());
+         return;
+         }
+      if(sender.messages.empty())
+         fair.active.push_back(from);
+      sender.messages.splice(sender.messages.end(), received, --received.end());
+      fair.count++;
+      }
+
+   /*!
+    * Deficit round-robin: each sender in turn is given its weight in quanta
+    * of bytes and may have messages received until they run out, so senders
+    * share the receiver by bytes rather than by how fast they send.
+    * @param waitUs Set to how long until a sender held back by its limit
+    * may have another message received, or -1.
+    * @return NULL if nothing may be received now.
+    */
+      static TMsg *
+   dequeueFair
+      (
+      TAgentKey key,
+      TFairQueue &fair,
+      Ts64 *waitUs
+      )
+      {
+      Ts64 now = timerNowUs();
+      size_t quantum = fair.quantum ? fair.quantum : MESSAGE_BODY_MEM_SIZE;
+      size_t held = 0;
+      *waitUs = -1;
+      while(held < fair.active.size())
+         {
+         TSenderQueue &sender = fair.senders[fair.active.front()];
+         refill(sender, now);
+         if(sender.perSecond && sender.tokens < 1000000)
+            {
+            Ts64 wait = (1000000 - sender.tokens + sender.perSecond - 1) / sender.perSecond;
+            if(*waitUs == -1 || wait < *waitUs)
+               *waitUs = wait;
+            held++;
+            fair.active.splice(fair.active.end(), fair.active, fair.active.begin());
+            fair.credited = FALSE;
+            continue;
+            }
+         if(!fair.credited)
+            {
+            sender.deficit += quantum * sender.weight;
+            fair.credited = TRUE;
+            }
+         TMsg &next = sender.messages.front();
+         size_t size = next.getBodySize() + sizeof(TMsg) - MESSAGE_BODY_MEM_SIZE;
+         if(size > sender.deficit)
+            {
+            held = 0;
+            fair.active.splice(fair.active.end(), fair.active, fair.active.begin());
+            fair.credited = FALSE;
+            continue;
+            }
+
+         sender.deficit -= size;
+         if(sender.perSecond)
+            sender.tokens -= 1000000;
+         std::list<TMsg> &received = msg::received_cache[key];
+         received.splice(received.end(), sender.messages, sender.messages.begin());
+         fair.count--;
+         if(sender.messages.empty())
+            {
+            sender.deficit = 0;
+            fair.active.pop_front();
+            fair.credited = FALSE;
+            }
+         return &received.back();
+         }
+      return NULL;
+      }
+
+   /*!
+    * receive for an agent with fair queuing: take what is in its queue, up
+    * to twice as many as it holds, and choose among the senders with
+    * dequeueFair.
+    */
+      static TMsg *
+   receiveFair
+      (
+      TAgentKey key,
+      TFairQueue &fair,
+      timespec *pTimeout
+      )
+      {
+      mqd_t mqd = msg::descriptor_cache[key];
+      struct timespec past;
+      past.tv_sec = 0;
+      past.tv_nsec = 0;
+      for(;;)
+         {
+         while(fair.quantum && fair.count < 2 * (size_t)msg::attribute_cache[key].mq_maxmsg && receiveFrom(key, mqd, &past))
+            enqueueFair(key, fair);
+         Ts64 waitUs;
+         TMsg *message = dequeueFair(key, fair, &waitUs);
+         if(message)
+            return message;
+
+         // wait for another message, or for a sender's limit to let up
+         struct timespec now;
+         clock_gettime(CLOCK_REALTIME, &now);
+         if(pTimeout && (pTimeout->tv_sec < now.tv_sec || (pTimeout->tv_sec == now.tv_sec && pTimeout->tv_nsec <= now.tv_nsec)))
+            return NULL;
+         timespec *until = pTimeout;
+         struct timespec deadline;
+         if(waitUs != -1)
+            {
+            deadline.tv_sec = now.tv_sec + waitUs / 1000000;
+            deadline.tv_nsec = now.tv_nsec + (waitUs % 1000000) * 1000;
+            if(deadline.tv_nsec >= 1000000000)
+               {
+               deadline.tv_sec++;
+               deadline.tv_nsec -= 1000000000;
+               }
+            if(!pTimeout || deadline.tv_sec < pTimeout->tv_sec || (deadline.tv_sec == pTimeout->tv_sec && deadline.tv_nsec < pTimeout->tv_nsec))
+               until = &deadline;
+            }
+         if(receiveFrom(key, mqd, until))
+            enqueueFair(key, fair);
+         else if(until == pTimeout || g_simulating)
+            return NULL;
+         }
+      }
+
+      static TMsg *
+   receive
+      (
+      TAgentKey key,
+      timespec* pTimeout
+      )
+      {
+      std::map<TAgentKey, TFairQueue>::iterator fair = fair_cache.find(key);
+      if(fair != fair_cache.end() && (fair->second.quantum || fair->second.count))
+         return receiveFair(key, fair->second, pTimeout);
+      return receiveFrom(key, msg::descriptor_cache[key], pTimeout);
+      }
+
+   /*!
+    * Split agent into count sub-queues, so that as many consumers can drain
+    * it in parallel (see receivePartition) while the messages about any one
+    * thing stay in order: messages go to the sub-queue given by a hash of
+    * their partitionKey field, e.g. an index column, or to the first if they
+    * have none. Producers and consumers must all call this, after
+    * createAgent, with the same arguments; a count of 1 undoes it. The
+    * sub-queues are removed with the agent by destroyAgent.
+    */
+      Ts32
+   setPartitions
+      (
+      TAgentKey agent,
+      size_t count,
+      TResourceKey partitionKey
+      )
+      {
+      std::map<TAgentKey, TPartitions>::iterator it = partition_cache.find(agent);
+      if(it != partition_cache.end())
+         {
+         for(size_t i = 0; i < it->second.queues.size(); i++)
+            mq_close(it->second.queues[i]);
+         partition_cache.erase(it);
+         }
+      // the simulated transport keeps order with one list per agent anyway
+      if(count <= 1 || g_simulating)
+         return SUCCESS;
+      if(!msg::descriptor_cache.count(agent))
+         {
+         MESSAGING_LOG_ERROR("Invalid key");
+         return FAILURE;
+         }
+
+      TPartitions &partitions = partition_cache[agent];
+      partitions.partitionKey = partitionKey;
+      mq_attr attr = msg::attribute_cache[agent];
+      for(size_t i = 0; i < count; i++)
+         {
+         Tn8 path[L_FIELD_MAX];
+         snprintf(path, sizeof(path), "%s.%u", getPath(agent), (unsigned)i);
+         mqd_t mqd = mq_open(path, (attr.mq_flags & O_NONBLOCK) | O_RDWR | O_CREAT, S_IRUSR | S_IWUSR, &attr);
+         if(-1 == mqd)
+            {
+            MESSAGING_LOG_ERROR("Cannot open \"%s\"", path);
+            MESSAGING_LOG_POSIX_ERROR;
+            setPartitions(agent, 1, NOT_A_RESOURCE);
+            return FAILURE;
+            }
+         partitions.queues.push_back(mqd);
+         }
+      return SUCCESS;
+      }
+
+   /*!
+    * receive, from one of the sub-queues made by setPartitions.
+    */
+      TMsg *
+   receivePartition
+      (
+      TAgentKey key,
+      size_t partition,
+      TBoolean blocking
+      )
+      {
+      std::map<TAgentKey, TPartitions>::iterator it = partition_cache.find(key);
+      if(it == partition_cache.end() || partition >= it->second.queues.size())
+         {
+         MESSAGING_LOG_ERROR("Invalid partition");
+         return NULL;
+         }
+      struct timespec timeout;
+      timeout.tv_nsec = 50;
+      timeout.tv_sec = 0;
+      return receiveFrom(key, it->second.queues[partition], blocking ? NULL : &timeout);
+      }
+
+      TMsg *
+   receive
+      (
+      TAgentKey key
+      )
+      {
+      struct timespec timeout;
+      timeout.tv_nsec = 50;
+      timeout.tv_sec = 0;
+      runTimers();
+      return receive(key, &timeout);
+      }
+
+   /*!
+    * The absolute time, by CLOCK_REALTIME as mq_timedsend and
+    * mq_timedreceive take it, us microseconds from now.
+    */
+      static struct timespec
+   deadlineIn
+      (
+      Ts64 us
+      )
+      {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += us / 1000000;
+      deadline.tv_nsec += (us % 1000000) * 1000;
+      if(deadline.tv_nsec >= 1000000000)
+         {
+         deadline.tv_sec++;
+         deadline.tv_nsec -= 1000000000;
+         }
+      return deadline;
+      }
+
+      TMsg *
+   blockingReceive
+      (
+      TAgentKey key
+      )
+      {
+      // wake up for timers going off meanwhile, see sendAfter
+      for(;;)
+         {
+         runTimers();
+         Ts64 waitUs = getNextTimer();
+         if(waitUs == -1 || g_simulating)
+            return receive(key, NULL);
+         struct timespec deadline = deadlineIn(waitUs);
+         TMsg *message = receive(key, &deadline);
+         if(message)
+            return message;
+         }
+      }
+
+   /*!
+    * Choose how waitReceive waits for messages to key: poll for up to spinUs
+    * microseconds, then poll yielding the CPU in between for up to yieldUs,
+    * then block. If adaptive, each phase is skipped while messages have been
+    * arriving further apart than it would wait, and the polling is cut short
+    * to twice the mean gap otherwise.
+    */
+      TVoid
+   setWaitStrategy
+      (
+      TAgentKey key,
+      size_t spinUs,
+      size_t yieldUs,
+      TBoolean adaptive
+      )
+      {
+      TWaitState &wait = wait_cache[key];
+      wait.spinUs = spinUs;
+      wait.yieldUs = yieldUs;
+      wait.adaptive = adaptive;
+      }
+
+   /*!
+    * Have receive take turns between the senders to key rather than go in
+    * order of arrival, so that one sending many messages cannot keep the
+    * others' waiting behind its own: each turn a sender may have up to
+    * quantum bytes of messages received, times its weight (see
+    * setSenderWeight). Messages from any one sender still come in order.
+    * Partitions (see receivePartition) are not affected.
+    * @param quantum 0 to go back to order of arrival, once the messages
+    * already taken from the queue have been received.
+    */
+      TVoid
+   setFairQueuing
+      (
+      TAgentKey key,
+      size_t quantum
+      )
+      {
+      fair_cache[key].quantum = quantum;
+      }
+
+   /*!
+    * Give sender weight times the share of others in key's fair queuing.
+    */
+      TVoid
+   setSenderWeight
+      (
+      TAgentKey key,
+      TAgentKey sender,
+      Tu32 weight
+      )
+      {
+      fair_cache[key].senders[sender].weight = weight > 0 ? weight : 1;
+      }
+
+   /*!
+    * Let messages from sender be received by key at no more than perSecond
+    * on average, or burst at once; as many more as burst may wait, and any
+    * beyond that are dropped. Takes effect with setFairQueuing.
+    * @param burst At least 1; 0 is taken as 1.
+    * @param perSecond 0 for no limit.
+    */
+      TVoid
+   setSenderLimit
+      (
+      TAgentKey key,
+      TAgentKey sender,
+      size_t perSecond,
+      size_t burst
+      )
+      {
+      TSenderQueue &queue = fair_cache[key].senders[sender];
+      queue.perSecond = perSecond;
+      // with no burst no token could ever be saved up, starving the sender
+      queue.burst = burst > 0 ? burst : 1;
+      queue.tokens = (Ts64)queue.burst * 1000000;
+      queue.refilledUs = timerNowUs();
+      }
+
+   /*!
+    * blockingReceive, but trading CPU for wakeup latency as chosen with
+    * setWaitStrategy. Timers go off on time meanwhile, as they do in
+    * blockingReceive.
+    */
+      TMsg *
+   waitReceive
+      (
+      TAgentKey key
+      )
+      {
+      TWaitState &wait = wait_cache[key];
+      Ts64 spinUs = wait.spinUs;
+      Ts64 yieldUs = wait.yieldUs;
+      if(wait.adaptive && wait.meanGapUs > 0)
+         {
+         Ts64 budget = 2 * wait.meanGapUs;
+         if(wait.meanGapUs > spinUs)
+            spinUs = 0;
+         else if(budget < spinUs)
+            spinUs = budget;
+         if(wait.meanGapUs > wait.spinUs + yieldUs)
+            yieldUs = 0;
+         else if(budget < spinUs + yieldUs)
+            yieldUs = budget - spinUs;
+         }
+
+      // virtual time only passes while blocked, see simulate
+      if(g_simulating)
+         spinUs = yieldUs = 0;
+
+      struct timespec past;
+      past.tv_sec = 0;
+      past.tv_nsec = 0;
+      TMsg *message = NULL;
+      Ts64 start = nowUs();
+      Ts64 elapsed = 0;
+      // polling stops for timers going off meanwhile, as blockingReceive
+      // wakes up for them
+      runTimers();
+      Ts64 timerUs = getNextTimer();
+      while(!message && elapsed < spinUs + yieldUs)
+         {
+         if(elapsed >= spinUs)
+            sched_yield();
+         message = receive(key, &past);
+         elapsed = nowUs() - start;
+         if(timerUs != -1 && elapsed >= timerUs)
+            {
+            runTimers();
+            timerUs = getNextTimer();
+            if(timerUs != -1)
+               timerUs += elapsed;
+            }
+         }
+      if(!message)
+         message = blockingReceive(key);
+
+      if(message)
+         {
+         Ts64 now = nowUs();
+         if(wait.lastArrivalUs)
+            wait.meanGapUs += (now - wait.lastArrivalUs - wait.meanGapUs) / 8;
+         wait.lastArrivalUs = now;
+         }
+      return message;
+      }
+
+
+   /*!
+    * The deepest node of the routing trie on the way to recipient's path
+    * that has a gateway or a socket address, or NULL if there is none.
+    */
+      static const TRouteNode *
+   findRoute
+      (
+      TAgentKey recipient
+      )
+      {
+      std::map<TAgentKey, const TRouteNode *>::iterator cached = route_cache.find(recipient);
+      if(cached != route_cache.end())
+         return cached->second;
+
+      const TRouteNode *found = NULL;
+      if(isKnownAgent(recipient))
+         {
+         std::string path = getPath(recipient);
+         TRouteNode *node = &route_root;
+         size_t start = 1;
+         while(node)
+            {
+            if(node->gateway != NOT_AN_AGENT || !node->address.empty())
+               found = node;
+            if(start >= path.size())
+               break;
+            size_t slash = path.find('/', start);
+            if(slash == std::string::npos)
+               slash = path.size();
+            std::map<std::string, TRouteNode>::iterator child = node->children.find(path.substr(start, slash - start));
+            node = child == node->children.end() ? NULL : &child->second;
+            start = slash + 1;
+            }
+         }
+      route_cache[recipient] = found;
+      return found;
+      }
+
+   /*!
+    * The agent whose queue a message for recipient actually goes into: the
+    * recipient itself if we have it open, otherwise the gateway of the longest
+    * route prefix of its path.
+    * @return NOT_AN_AGENT if there is no way to reach recipient through a
+    * queue.
+    */
+      static TAgentKey
+   route
+      (
+      TAgentKey recipient
+      )
+      {
+      if(msg::descriptor_cache.count(recipient))
+         return recipient;
+      const TRouteNode *node = findRoute(recipient);
+      return node ? node->gateway : NOT_AN_AGENT;
+      }
+
+   /*!
+    * @param prefix An agent path, optionally ending in a wildcard.
+    * @return The node of the routing trie for prefix, or NULL if there is
+    * none and create is FALSE.
+    */
+      static TRouteNode *
+   routeNode
+      (
+      Tnc8 *prefix,
+      TBoolean create
+      )
+      {
+      std::string path(prefix);
+      if(path.size() >= 2 && path.compare(path.size() - 2, 2, "/*") == 0)
+         path.erase(path.size() - 2);
+
+      TRouteNode *node = &route_root;
+      size_t start = 1;
+      while(node && start < path.size())
+         {
+         size_t slash = path.find('/', start);
+         if(slash == std::string::npos)
+            slash = path.size();
+         if(slash > start)
+            {
+            if(create)
+               node = &node->children[path.substr(start, slash - start)];
+            else
+               {
+               std::map<std::string, TRouteNode>::iterator child = node->children.find(path.substr(start, slash - start));
+               node = child == node->children.end() ? NULL : &child->second;
+               }
+            }
+         start = slash + 1;
+         }
+      return node;
+      }
+
+   /*!
+    * Send everything addressed to an agent under prefix, e.g. "/remote" (a
+    * trailing wildcard is allowed), to gateway unless we have the agent open
+    * ourselves. The gateway gets the message as it was, recipient and all,
+    * and passes it on with forward.
+    */
+      Ts32
+   addRoute
+      (
+      Tnc8 *prefix,
+      TAgentKey gateway
+      )
+      {
+      if(prefix[0] != '/' || !msg::descriptor_cache.count(gateway))
+         {
+         MESSAGING_LOG_ERROR("Cannot route \"%s\" through '%s'", prefix, getPath(gateway));
+         return FAILURE;
+         }
+
+      TRouteNode *node = routeNode(prefix, TRUE);
+      node->gateway = gateway;
+      node->address.clear();
+      route_cache.clear();
+      return SUCCESS;
+      }
+
+   /*!
+    * Like addRoute, but everything addressed to an agent under prefix goes
+    * over a socket to address (see msg::sock), where another process hands it
+    * on with pollSockets.
+    */
+      Ts32
+   addSocketRoute
+      (
+      Tnc8 *prefix,
+      Tnc8 *address
+      )
+      {
+      if(prefix[0] != '/')
+         {
+         MESSAGING_LOG_ERROR("Cannot route \"%s\" to \"%s\"", prefix, address);
+         return FAILURE;
+         }
+
+      TRouteNode *node = routeNode(prefix, TRUE);
+      node->gateway = NOT_AN_AGENT;
+      node->address = address;
+      route_cache.clear();
+      return SUCCESS;
+      }
+
+      TVoid
+   removeRoute
+      (
+      Tnc8 *prefix
+      )
+      {
+      TRouteNode *node = routeNode(prefix, FALSE);
+      if(node)
+         {
+         node->gateway = NOT_AN_AGENT;
+         node->address.clear();
+         }
+      route_cache.clear();
+      }
+
+   /*!
+    * @return The timer's id, see cancelTimer.
+    */
+      static size_t
+   startTimer
+      (
+      TScheduled *s,
+      Ts64 dueUs
+      )
+      {
+      if(!timer_wheel_ready)
+         {
+         timer::init(&timer_wheel, timerNowUs() / TIMER_TICK_US);
+         timer_wheel_ready = TRUE;
+         }
+      s->id = scheduled_next_id++;
+      // round up, so as never to go off early
+      s->timer.due = (dueUs + TIMER_TICK_US - 1) / TIMER_TICK_US;
+      timer::add(&timer_wheel, &s->timer);
+      scheduled[s->id] = s;
+      return s->id;
+      }
+
+   /*!
+    * Write out what is batched for sockets within SOCKET_FLUSH_US, if it is
+    * not written sooner by filling a batch or by flushSockets.
+    */
+      static TVoid
+   scheduleFlush()
+      {
+      if(flush_timer_pending)
+         return;
+      TScheduled *s = new TScheduled;
+      s->periodTicks = 0;
+      s->kind = SCHEDULED_FLUSH;
+      s->agent = NOT_AN_AGENT;
+      startTimer(s, timerNowUs() + SOCKET_FLUSH_US);
+      flush_timer_pending = TRUE;
+      }
+
+   /*!
+    * Send a message from sender to recipient, in count pieces, over the
+    * pooled connection to address, opening it if need be and once more if it
+    * has broken. Keys are only good on the host that gave them out (see
+    * msg::registry), so the frame starts with the paths of sender and
+    * recipient, each ending in a null, for forwardFrame to look up again.
+    */
+      static TSendResult
+   deliverSocket
+      (
+      TAgentKey sender,
+      TAgentKey recipient,
+      const struct iovec *iov,
+      size_t count,
+      const std::string &address
+      )
+      {
+      std::string paths = getPath(recipient);
+      if(paths.empty() || count > 1 + 2*SEGMENTS_MAX)
+         {
+         MESSAGING_LOG_ERROR("Cannot send to \"%s\"", address.c_str());
+         return SEND_INVALID;
+         }
+      paths.insert(0, 1, '\0');
+      paths.insert(0, getPath(sender));
+      paths += '\0';
+      struct iovec pieces[2 + 2*SEGMENTS_MAX];
+      pieces[0].iov_base = (TVoid *)paths.data();
+      pieces[0].iov_len = paths.size();
+      for(size_t i = 0; i < count; i++)
+         pieces[i + 1] = iov[i];
+
+      for(size_t attempt = 0; attempt < 2; attempt++)
+         {
+         std::map<std::string, sock::TConnection>::iterator it = socket_pool.find(address);
+         if(it == socket_pool.end())
+            {
+            int fd = sock::open(address.c_str(), FALSE);
+            if(-1 == fd)
+               return SEND_ERROR;
+            sock::TConnection c;
+            c.fd = fd;
+            it = socket_pool.insert(std::make_pair(address, c)).first;
+            }
+         if(SUCCESS == sock::writev(&it->second, pieces, count + 1, g_batchSockets))
+            {
+            if(!it->second.out.empty())
+               scheduleFlush();
+            return SEND_OK;
+            }
+         close(it->second.fd);
+         socket_pool.erase(it);
+         }
+      return SEND_ERROR;
+      }
+
+      static TSendResult
+   deliverSocket
+      (
+      TMsg *message,
+      const std::string &address
+      )
+      {
+      if(hasAttachments(message))
+         {
+         MESSAGING_LOG_ERROR("Attachments cannot go over a socket");
+         return SEND_INVALID;
+         }
+      struct iovec iov;
+      iov.iov_base = message;
+      iov.iov_len = message->getBodySize() + sizeof(TMsg) - MESSAGE_BODY_MEM_SIZE;
+      return deliverSocket(message->getSender(), message->getRecipient(), &iov, 1, address);
+      }
+
+   /*!
+    * Hold messages going over sockets back to be sent in batches, or not.
+    * Either way flushSockets sends whatever is being held, as runTimers does
+    * within SOCKET_FLUSH_US.
+    */
+      TVoid
+   setSocketBatching
+      (
+      TBoolean batch
+      )
+      {
+      g_batchSockets = batch;
+      if(!batch)
+         flushSockets();
+      }
+
+      TVoid
+   flushSockets()
+      {
+      std::map<std::string, sock::TConnection>::iterator it;
+      for(it = socket_pool.begin(); it != socket_pool.end(); it++)
+         sock::flush(&it->second);
+      }
+
+   /*!
+    * Take messages for our agents from other hosts at address.
+    */
+      Ts32
+   listenSocket
+      (
+      Tnc8 *address
+      )
+      {
+      int fd = sock::open(address, TRUE);
+      if(-1 == fd)
+         return FAILURE;
+      socket_listeners.push_back(fd);
+      return SUCCESS;
+      }
+
+   /*!
+    * Hand on a frame made by deliverSocket, with its sender and recipient
+    * given our keys for their paths.
+    */
+      static TVoid
+   forwardFrame
+      (
+      const TVoid *frame,
+      size_t length,
+      TVoid *context
+      )
+      {
+      Tnc8 *senderPath = (Tnc8 *)frame;
+      Tnc8 *end = senderPath + length;
+      Tnc8 *senderEnd = (Tnc8 *)memchr(senderPath, '\0', length);
+      Tnc8 *recipientPath = senderEnd ? senderEnd + 1 : end;
+      Tnc8 *recipientEnd = (Tnc8 *)memchr(recipientPath, '\0', end - recipientPath);
+      if(!recipientEnd)
+         {
+         MESSAGING_LOG_ERROR("Frame of %u bytes has no paths", length);
+         return;
+         }
+      Tnc8 *body = recipientEnd + 1;
+      length = end - body;
+
+      TMsg message;
+      size_t headerSize = sizeof(TMsg) - MESSAGE_BODY_MEM_SIZE;
+      if(length > sizeof(message) || length < headerSize)
+         {
+         MESSAGING_LOG_ERROR("Frame of %u bytes is not a message", length);
+         return;
+         }
+      memcpy(&message, body, length);
+      if(message.getBodySize() != length - headerSize)
+         {
+         MESSAGING_LOG_ERROR("Frame of %u bytes claims %u bytes of body", length, (unsigned)message.getBodySize());
+         return;
+         }
+      TAgentKey recipient = getAgentKey(recipientPath);
+      if(recipient == NOT_AN_AGENT)
+         {
+         MESSAGING_LOG_ERROR("No agent '%s' here to forward to", recipientPath);
+         return;
+         }
+      message.setRecipient(recipient);
+      message.setSender(getAgentKey(senderPath));
+      *(size_t *)context += SUCCESS == forward(&message);
+      }
+
+   /*!
+    * Accept connections at the addresses we listen at and pass every message
+    * that has arrived on to its recipient's queue.
+    * @param timeoutMs How long to wait for something to arrive, as for poll.
+    * @return The number of messages passed on.
+    */
+      size_t
+   pollSockets
+      (
+      Ts32 timeoutMs
+      )
+      {
+      std::vector<struct pollfd> fds;
+      std::list<int>::iterator l;
+      for(l = socket_listeners.begin(); l != socket_listeners.end(); l++)
+         {
+         struct pollfd p = {*l, POLLIN, 0};
+         fds.push_back(p);
+         }
+      size_t nListeners = fds.size();
+      std::list<sock::TConnection>::iterator c;
+      for(c = socket_accepted.begin(); c != socket_accepted.end(); c++)
+         {
+         struct pollfd p = {c->fd, POLLIN, 0};
+         fds.push_back(p);
+         }
+      if(fds.empty() || poll(&fds[0], fds.size(), timeoutMs) <= 0)
+         return 0;
+
+      size_t forwarded = 0;
+      size_t i = nListeners;
+      for(c = socket_accepted.begin(); c != socket_accepted.end(); i++)
+         {
+         if(fds[i].revents && -1 == sock::read(&*c, forwardFrame, &forwarded))
+            {
+            close(c->fd);
+            socket_accepted.erase(c++);
+            }
+         else
+            c++;
+         }
+      for(i = 0; i < nListeners; i++)
+         {
+         if(fds[i].revents & POLLIN)
+            {
+            sock::TConnection accepted;
+            accepted.fd = accept(fds[i].fd, NULL, NULL);
+            if(-1 != accepted.fd)
+               socket_accepted.push_back(accepted);
+            }
+         }
+      return forwarded;
+      }
+
+   /*!
+    * The queue of via that message goes into, see setPartitions.
+    */
+      static mqd_t
+   choosePartition
+      (
+      TMsg *message,
+      TAgentKey via
+      )
+      {
+      std::map<TAgentKey, TPartitions>::iterator it = partition_cache.find(via);
+      if(it == partition_cache.end())
+         return msg::descriptor_cache[via];
+      const TPartitions &partitions = it->second;
+      Tu32 hash = 2166136261u; // FNV-1a
+      for(TFieldCursor field(*message); field.valid(); field.next())
+         {
+         if(field.key() == partitions.partitionKey)
+            {
+            const T8 *value = (const T8 *)field.value();
+            for(size_t i = 0; i < field.length(); i++)
+               hash = (hash ^ value[i]) * 16777619u;
+            return partitions.queues[hash % partitions.queues.size()];
+            }
+         }
+      return partitions.queues[0];
+      }
+
+   /*!
+    * @param deadline Absolute time (CLOCK_REALTIME) to give up waiting for
+    * room in the queue, or NULL to wait as long as mq_send would.
+    */
+      static TSendResult
+   deliverWithin
+      (
+      TMsg *message,
+      TAgentKey via,
+      const timespec *deadline
+      )
+      {
+      if(via == NOT_AN_AGENT)
+         {
+         // a recipient on another host, see addSocketRoute
+         const TRouteNode *node = findRoute(message->getRecipient());
+         if(!node || node->address.empty())
+            return SEND_INVALID;
+         return deliverSocket(message, node->address);
+         }
+      // the copy delivered holds its attachments until mapped or dropped,
+      // taken first so that they cannot go before the recipient has it
+      if(!holdAttachments(message, 1, FALSE))
+         {
+         holdAttachments(message, -1, FALSE);
+         return SEND_INVALID;
+         }
+      if(g_simulating)
+         {
+         TSendResult result = simDeliver(message, via);
+         if(result != SEND_OK)
+            holdAttachments(message, -1, FALSE);
+         return result;
+         }
+#ifndef SOLIPSISM
+//      MESSAGING_LOG_INFO("Sending %s message from '%s' to '%s'", verb_to_string(msg->verb), agent_names[msg->sender].c_str(), agent_names[msg->recipient].c_str());
+      size_t size = message->getBodySize() + sizeof(TMsg) - MESSAGE_BODY_MEM_SIZE;
+      mqd_t mqd = choosePartition(message, via);
+      Ts32 result;
+      if(deadline)
+         result = mq_timedsend(mqd, (const char*)message, size, 1, deadline);
+      else
+         result = mq_send(mqd, (const char*)message, size, 1);
+      if(-1 == result)
+         {
+         holdAttachments(message, -1, FALSE);
+         if(errno == EAGAIN)
+            {
+            if(!deadline)
+               MESSAGING_LOG_POSIX_ERROR;
+            return SEND_FULL;
+            }
+         if(errno == ETIMEDOUT)
+            return SEND_TIMEOUT;
+         MESSAGING_LOG_POSIX_ERROR;
+         return SEND_ERROR;
+         }
+#else
+      // Put the message directly into the receiver's list since the
+      // sender and receiver are one in the mind of a solipsist.
+      msg::received_cache[via].push_back(*message);
+#endif
+      return SEND_OK;
+      }
+
+      static Ts32
+   deliver
+      (
+      TMsg *message,
+      TAgentKey via
+      )
+      {
+      return SEND_OK == deliverWithin(message, via, NULL) ? SUCCESS : FAILURE;
+      }
+
+   /*!
+    * Two SETs with the same coalescing key are about the same thing, so only
+    * the later one need be delivered: same sender, same recipient, the same
+    * resources in the same order and the same values in any index column.
+    */
+      static std::string
+   coalescingKey
+      (
+      TMsg *message
+      )
+      {
+      std::string key;
+      TAgentKey sender = message->getSender();
+      TAgentKey recipient = message->getRecipient();
+      key.append((Tnc8 *)&sender, sizeof(sender));
+      key.append((Tnc8 *)&recipient, sizeof(recipient));
+
+      size_t iBody;
+      for(iBody = 0; iBody < message->getBodySize(); iBody = message->getNextFieldOffset(iBody))
+         {
+         TResourceKey rk = message->getResourceKey(iBody);
+         key.append((Tnc8 *)&rk, sizeof(rk));
+         lockNames();
+         std::map<TResourceKey, std::string>::iterator name = resource_names.find(rk);
+         TBoolean isIndex = name != resource_names.end() &&
+            name->second.size() > 5 &&
+            name->second.compare(name->second.size() - 5, 5, "Index") == 0;
+         unlockNames();
+         if(isIndex)
+            {
+            key.append(message->getFieldPointer(iBody), message->getFieldSize(iBody));
+            }
+         }
+      return key;
+      }
+
+   /*!
+    * Sync recipient's journal within JOURNAL_COMMIT_US of what was just
+    * journaled, if it is not synced sooner by the group commit.
+    */
+      static TVoid
+   scheduleCommit
+      (
+      TAgentKey recipient
+      )
+      {
+      if(commit_timers.count(recipient))
+         return;
+      TScheduled *s = new TScheduled;
+      s->periodTicks = 0;
+      s->kind = SCHEDULED_COMMIT;
+      s->agent = recipient;
+      commit_timers[recipient] = startTimer(s, timerNowUs() + JOURNAL_COMMIT_US);
+      }
+
+   /*!
+    * Try sendHeld again soon while anything is held for recipient, so that
+    * it does not wait for the next message.
+    */
+      static TVoid
+   scheduleHeld
+      (
+      TAgentKey recipient
+      )
+      {
+      if(held_timers.count(recipient))
+         return;
+      TScheduled *s = new TScheduled;
+      s->periodTicks = 0;
+      s->kind = SCHEDULED_HELD;
+      s->agent = recipient;
+      held_timers[recipient] = startTimer(s, timerNowUs() + TIMER_TICK_US);
+      }
+
+   /*!
+    * Put message into the queue of via, on its way to its recipient, having
+    * it pay a credit (see setCredits) and journaling it (see setPersistent)
+    * if need be.
+    */
+      static TSendResult
+   deliverCharged
+      (
+      TMsg *message,
+      TAgentKey via,
+      const timespec *deadline
+      )
+      {
+      TAgentKey recipient = message->getRecipient();
+      std::map<TAgentKey, size_t>::iterator credits = credit_cache.find(recipient);
+      if(credits != credit_cache.end() && credits->second == 0)
+         return SEND_NO_CREDIT;
+
+      TSendResult result;
+      std::map<TAgentKey, journal::TJournal *>::iterator journaled = journal_cache.find(recipient);
+      if(journaled != journal_cache.end())
+         {
+         // what goes into the queue carries its place in the journal, so the
+         // recipient can acknowledge it
+         TMsg copy = *message;
+         Ts64 sequence = 0;
+         size_t fieldStart = copy.getBodySize();
+         copy.append(RESOURCE_JOURNAL, sizeof(sequence), &sequence);
+         if(!copy.isValid())
+            return SEND_ERROR;
+         size_t sequenceAt = copy.getFieldPointer(fieldStart) - (Tnc8 *)&copy;
+         size_t length = copy.getBodySize() + sizeof(TMsg) - MESSAGE_BODY_MEM_SIZE;
+         sequence = journal::append(journaled->second, &copy, length, sequenceAt);
+         if(sequence < 0)
+            return SEND_ERROR;
+         result = deliverWithin(&copy, via, deadline);
+         // only what was sent is to be replayed, so a retry is not journaled twice
+         if(result != SEND_OK)
+            journal::cancel(journaled->second, sequence);
+         else if(journaled->second->uncommitted > 0)
+            scheduleCommit(recipient);
+         }
+      else
+         {
+         result = deliverWithin(message, via, deadline);
+         }
+      if(result == SEND_OK && credits != credit_cache.end())
+         credits->second--;
+      return result;
+      }
+
+      static TBoolean
+   isBackedUp
+      (
+      TMsg *message,
+      TAgentKey via
+      )
+      {
+      // a socket is only ever written to, never waited on
+      if(via == NOT_AN_AGENT)
+         return FALSE;
+      if(g_simulating)
+         return sim_queues[via].size() + sim_pending[via] >= (g_sim.capacity ? g_sim.capacity : msg::attribute_cache[via].mq_maxmsg);
+#ifndef SOLIPSISM
+      mq_attr attr;
+      if(0 != mq_getattr(choosePartition(message, via), &attr))
+         return FALSE;
+      return attr.mq_curmsgs >= attr.mq_maxmsg;
+#else
+      return FALSE;
+#endif
+      }
+
+   /*!
+    * Deliver as many of the messages held back from recipient (see
+    * FLAG_COALESCE) as its queue will take, each paying its credit and being
+    * journaled as it goes. Called for every send to recipient, and on a timer
+    * while anything is held.
+    * @return The number still held.
+    */
+      size_t
+   sendHeld
+      (
+      TAgentKey recipient
+      )
+      {
+      std::map<TAgentKey, THeld>::iterator it = held_cache.find(recipient);
+      if(it == held_cache.end())
+         return 0;
+
+      THeld &held = it->second;
+      TAgentKey via = route(recipient);
+      struct timespec past;
+      past.tv_sec = 0;
+      past.tv_nsec = 0;
+      while(!held.messages.empty() && !isBackedUp(&held.messages.front().second, via))
+         {
+         if(SEND_OK != deliverCharged(&held.messages.front().second, via, &past))
+            break;
+         std::map<std::string, std::list<std::pair<std::string, TMsg> >::iterator>::iterator byKey =
+               held.byKey.find(held.messages.front().first);
+         if(byKey != held.byKey.end() && byKey->second == held.messages.begin())
+            held.byKey.erase(byKey);
+         held.messages.pop_front();
+         }
+
+      size_t count = held.messages.size();
+      if(count == 0)
+         held_cache.erase(it);
+      return count;
+      }
+
+   /*!
+    * Hold a message back from a backed-up recipient. A SET replaces any held
+    * SET with the same coalescing key rather than queueing behind it.
+    */
+      static TVoid
+   hold
+      (
+      TMsg *message
+      )
+      {
+      THeld &held = held_cache[message->getRecipient()];
+      scheduleHeld(message->getRecipient());
+      if(message->getVerb() != REST_SET)
+         {
+         // nothing held before it may be replaced by something sent after it
+         held.byKey.clear();
+         held.messages.push_back(std::make_pair(std::string(), *message));
+         return;
+         }
+      std::string key = coalescingKey(message);
+      if(held.byKey.count(key))
+         {
+         held.byKey[key]->second = *message;
+         }
+      else
+         {
+         held.messages.push_back(std::make_pair(key, *message));
+         held.byKey[key] = --held.messages.end();
+         }
+      }
+
+      static TSendResult
+   sendWithin
+      (
+      TMsg *message,
+      const timespec *deadline
+      )
+      {
+      if(!msg::descriptor_cache.count(message->getSender()))
+         {
+         MESSAGING_LOG_INFO("Invalid sender");
+         return SEND_INVALID;
+         }
+
+      TAgentKey recipient = message->getRecipient();
+      TAgentKey via = route(recipient);
+      if(via == NOT_AN_AGENT)
+         {
+         // unless it goes over a socket, which deliverWithin sees to
+         const TRouteNode *node = findRoute(recipient);
+         if(!node || node->address.empty())
+            {
+            MESSAGING_LOG_ERROR("Invalid recipient");
+            return SEND_INVALID;
+            }
+         }
+
+      MESSAGING_LOG_INFO("sending message: '%s' ===> '%s'", getPath(message->getSender()), getPath(recipient));
+      std::map<TAgentKey, size_t>::iterator credits = credit_cache.find(recipient);
+      if(credits != credit_cache.end() && credits->second == 0)
+         return SEND_NO_CREDIT;
+
+      TBoolean coalescing = (special_flags[recipient] & FLAG_COALESCE) != 0;
+      if(coalescing || held_cache.count(recipient))
+         {
+         // anything already held goes first, whatever the verb, to keep the order
+         if(sendHeld(recipient) > 0 || (coalescing && message->getVerb() == REST_SET && isBackedUp(message, via)))
+            {
+            hold(message);
+            return SEND_OK;
+            }
+         }
+      return deliverCharged(message, via, deadline);
+      }
+
+   /*!
+    * Try recipient's retry queue again after the backoff for the number of
+    * times its oldest message has failed.
+    */
+      static TVoid
+   scheduleRetry
+      (
+      TAgentKey recipient,
+      TRetryQueue &queue
+      )
+      {
+      const TRetryPolicy &policy = retry_policies[recipient];
+      Ts64 delayUs = policy.firstDelayUs;
+      for(Tu32 i = 0; i < queue.attempts && delayUs < policy.maxDelayUs; i++)
+         delayUs *= 2;
+      if(delayUs > policy.maxDelayUs)
+         delayUs = policy.maxDelayUs;
+      TScheduled *s = new TScheduled;
+      s->periodTicks = 0;
+      s->kind = SCHEDULED_RETRY;
+      s->agent = recipient;
+      queue.timer = startTimer(s, timerNowUs() + delayUs);
+      }
+
+   /*!
+    * trySend, but straight to the queue, for the retry queue itself.
+    */
+      static TSendResult
+   sendNow
+      (
+      TMsg *message
+      )
+      {
+      struct timespec past;
+      past.tv_sec = 0;
+      past.tv_nsec = 0;
+      TSendResult result = sendWithin(message, &past);
+      return result == SEND_TIMEOUT ? SEND_FULL : result;
+      }
+
+      static TVoid
+   giveUp
+      (
+      TMsg *message
+      )
+      {
+      TAgentKey deadLetter = retry_policies[message->getRecipient()].deadLetter;
+      TAgentKey via = deadLetter == NOT_AN_AGENT ? NOT_AN_AGENT : route(deadLetter);
+      // never waits, since a timer is running: a full dead-letter queue
+      // drops it like having none
+      struct timespec past;
+      past.tv_sec = 0;
+      past.tv_nsec = 0;
+      // the recipient is left as it was, to tell the dead-letter agent whose it was
+      if(via == NOT_AN_AGENT || SEND_OK != deliverWithin(message, via, &past))
+         MESSAGING_LOG_ERROR("Dropped message to '%s' after %u retries", getPath(message->getRecipient()), retry_policies[message->getRecipient()].attempts);
+      else
+         MESSAGING_LOG_INFO("Gave up on message to '%s', sent it to '%s'", getPath(message->getRecipient()), getPath(deadLetter));
+      }
+
+   /*!
+    * Send as much of recipient's retry queue as its queue will take.
+    * @return The number sent.
+    */
+      static size_t
+   retry
+      (
+      TAgentKey recipient
+      )
+      {
+      std::map<TAgentKey, TRetryQueue>::iterator it = retry_cache.find(recipient);
+      if(it == retry_cache.end())
+         return 0;
+
+      TRetryQueue &queue = it->second;
+      queue.timer = 0;
+      size_t sent = 0;
+      while(!queue.messages.empty())
+         {
+         TSendResult result = sendNow(&queue.messages.front());
+         if(result == SEND_OK)
+            {
+            sent++;
+            queue.attempts = 0;
+            }
+         else if((result == SEND_FULL || result == SEND_NO_CREDIT)
+               && ++queue.attempts <= retry_policies[recipient].attempts)
+            {
+            break;
+            }
+         else
+            {
+            giveUp(&queue.messages.front());
+            queue.attempts = 0;
+            }
+         queue.messages.pop_front();
+         }
+
+      if(queue.messages.empty())
+         retry_cache.erase(it);
+      else
+         scheduleRetry(recipient, queue);
+      return sent;
+      }
+
+   /*!
+    * Send, or if recipient has a TRetryPolicy and its queue is full, leave
+    * the message to be retried. Messages wait behind any already waiting, so
+    * that they still arrive in the order sent. Every way of sending comes
+    * through here, so that none can overtake them.
+    * @param deadline As for sendWithDeadline, unless recipient has a
+    * TRetryPolicy, in which case the message never waits for room.
+    */
+      static TSendResult
+   sendOrRetry
+      (
+      TMsg *message,
+      const timespec *deadline
+      )
+      {
+      TAgentKey recipient = message->getRecipient();
+      std::map<TAgentKey, TRetryPolicy>::iterator policy = retry_policies.find(recipient);
+      if(policy == retry_policies.end())
+         return sendWithin(message, deadline);
+
+      std::map<TAgentKey, TRetryQueue>::iterator waiting = retry_cache.find(recipient);
+      if(waiting == retry_cache.end())
+         {
+         // never block, whether or not the queue was opened with O_NONBLOCK
+         TSendResult result = sendNow(message);
+         if(result != SEND_FULL && result != SEND_NO_CREDIT)
+            return result;
+         }
+      else if(policy->second.capacity && waiting->second.messages.size() >= policy->second.capacity)
+         {
+         return SEND_FULL;
+         }
+
+      TRetryQueue &queue = retry_cache[recipient];
+      queue.messages.push_back(*message);
+      if(queue.messages.size() == 1)
+         {
+         queue.attempts = 0;
+         scheduleRetry(recipient, queue);
+         }
+      return SEND_OK;
+      }
+
+      Ts32
+   send(TMsg *message)
+      {
+      return SEND_OK == sendOrRetry(message, NULL) ? SUCCESS : FAILURE;
+      }
+
+   /*!
+    * Send the handle's message and, once sent, give it back to the pool. If
+    * it cannot be sent the handle still owns it, to retry or drop.
+    */
+      Ts32
+   send(TMsgHandle &handle)
+      {
+      if(handle.isEmpty())
+         return FAILURE;
+      if(SEND_OK != sendOrRetry(handle.get(), NULL))
+         return FAILURE;
+      handle.reset();
+      return SUCCESS;
+      }
+
+   /*!
+    * Send without waiting for room in the recipient's queue, whether or not
+    * it was opened with O_NONBLOCK.
+    */
+      TSendResult
+   trySend(TMsg *message)
+      {
+      struct timespec past;
+      past.tv_sec = 0;
+      past.tv_nsec = 0;
+      TSendResult result = sendOrRetry(message, &past);
+      return result == SEND_TIMEOUT ? SEND_FULL : result;
+      }
+
+   /*!
+    * Send, waiting for room in the recipient's queue no later than deadline.
+    * A recipient with a TRetryPolicy is never waited on, see setRetry.
+    * @param deadline Absolute time (CLOCK_REALTIME), as for mq_timedsend.
+    */
+      TSendResult
+   sendWithDeadline
+      (
+      TMsg *message,
+      const timespec *deadline
+      )
+      {
+      return sendOrRetry(message, deadline);
+      }
+
+   /*!
+    * @return The timer's id, for cancelTimer, or 0 if message is not valid.
+    */
+      static size_t
+   schedule
+      (
+      TMsg *message,
+      Ts64 dueUs,
+      Ts64 periodTicks
+      )
+      {
+      if(!message->isValid())
+         return 0;
+      TScheduled *s = new TScheduled;
+      s->periodTicks = periodTicks;
+      s->kind = SCHEDULED_SEND;
+      s->agent = NOT_AN_AGENT;
+      s->message.assign((Tnc8 *)message, message->getBodySize() + sizeof(TMsg) - MESSAGE_BODY_MEM_SIZE);
+      return startTimer(s, dueUs);
+      }
+
+   /*!
+    * Send a copy of message at when, an absolute time (CLOCK_REALTIME) as
+    * for sendWithDeadline, to within TIMER_TICK_US. Timers go off in
+    * blockingReceive and receive, or in runTimers for those with a loop of
+    * their own.
+    * @return The timer's id, for cancelTimer, or 0 on failure.
+    */
+      size_t
+   sendAt
+      (
+      TMsg *message,
+      const timespec *when
+      )
+      {
+      struct timespec now;
+      clock_gettime(CLOCK_REALTIME, &now);
+      Ts64 delayUs = (Ts64)(when->tv_sec - now.tv_sec) * 1000000 + (when->tv_nsec - now.tv_nsec) / 1000;
+      return sendAfter(message, delayUs > 0 ? delayUs : 0);
+      }
+
+   /*!
+    * sendAt, delayUs microseconds from now.
+    */
+      size_t
+   sendAfter
+      (
+      TMsg *message,
+      Ts64 delayUs
+      )
+      {
+      return schedule(message, timerNowUs() + delayUs, 0);
+      }
+
+   /*!
+    * Send a copy of message every periodUs microseconds from now on, until
+    * cancelled. Each time is reckoned from when the last was due, not from
+    * when it was sent, so the period does not drift; times missed altogether
+    * are skipped rather than made up in a burst.
+    * @param periodUs Rounded to the nearest TIMER_TICK_US (1 ms), and never
+    * less than one.
+    */
+      size_t
+   sendEvery
+      (
+      TMsg *message,
+      Ts64 periodUs
+      )
+      {
+      Ts64 periodTicks = (periodUs + TIMER_TICK_US / 2) / TIMER_TICK_US;
+      if(periodTicks < 1)
+         periodTicks = 1;
+      return schedule(message, timerNowUs() + periodTicks * TIMER_TICK_US, periodTicks);
+      }
+
+   /*!
+    * @return Whether there was such a timer.
+    */
+      TBoolean
+   cancelTimer
+      (
+      size_t id
+      )
+      {
+      std::map<size_t, TScheduled *>::iterator it = scheduled.find(id);
+      if(it == scheduled.end())
+         return FALSE;
+      timer::remove(&timer_wheel, &it->second->timer);
+      delete it->second;
+      scheduled.erase(it);
+      return TRUE;
+      }
+
+      static bool
+   isDueBefore
+      (
+      const TScheduled *a,
+      const TScheduled *b
+      )
+      {
+      return a->timer.due < b->timer.due || (a->timer.due == b->timer.due && a->id < b->id);
+      }
+
+   /*!
+    * Send whatever messages have fallen due, in the order they were due.
+    * @return The number sent.
+    */
+      size_t
+   runTimers()
+      {
+      if(!timer_wheel_ready || scheduled.empty())
+         return 0;
+      Ts64 now = timerNowUs() / TIMER_TICK_US;
+      std::vector<TScheduled *> due;
+      for(timer::TTimer *t = timer::expire(&timer_wheel, now); t; t = t->next)
+         due.push_back((TScheduled *)t);
+      std::sort(due.begin(), due.end(), isDueBefore);
+
+      size_t sent = 0;
+      for(size_t i = 0; i < due.size(); i++)
+         {
+         TScheduled *s = due[i];
+         if(s->kind == SCHEDULED_RETRY)
+            {
+            sent += retry(s->agent);
+            }
+         else if(s->kind == SCHEDULED_COMMIT)
+            {
+            commit_timers.erase(s->agent);
+            syncPersistent(s->agent);
+            }
+         else if(s->kind == SCHEDULED_FLUSH)
+            {
+            flush_timer_pending = FALSE;
+            flushSockets();
+            }
+         else if(s->kind == SCHEDULED_HELD)
+            {
+            held_timers.erase(s->agent);
+            if(sendHeld(s->agent) > 0)
+               scheduleHeld(s->agent);
+            }
+         else
+            {
+            TMsg message;
+            memcpy(&message, s->message.data(), s->message.size());
+            if(SEND_OK == sendOrRetry(&message, NULL))
+               sent++;
+            }
+         if(s->periodTicks)
+            {
+            s->timer.due += s->periodTicks;
+            if(s->timer.due <= now)
+               s->timer.due += ((now - s->timer.due) / s->periodTicks + 1) * s->periodTicks;
+            timer::add(&timer_wheel, &s->timer);
+            }
+         else
+            {
+            scheduled.erase(s->id);
+            delete s;
+            }
+         }
+      return sent;
+      }
+
+   /*!
+    * How long until a timer may go off, e.g. for a timeout of one's own.
+    * @return Microseconds, or -1 if there are no timers.
+    */
+      Ts64
+   getNextTimer()
+      {
+      if(!timer_wheel_ready)
+         return -1;
+      Ts64 due = timer::nextDue(&timer_wheel);
+      if(due == -1)
+         return -1;
+      Ts64 waitUs = due * TIMER_TICK_US - timerNowUs();
+      return waitUs > 0 ? waitUs : 0;
+      }
+
+   /*!
+    * Have send, rather than fail, leave messages that find recipient's queue
+    * full to be retried with exponential backoff, and never block on it. A
+    * message still undelivered after policy->attempts retries goes to
+    * policy->deadLetter. Retries happen in runTimers, like sendAfter, so a
+    * process that never receives has to call runTimers itself, or
+    * drainRetries before it exits.
+    * @param policy NULL to stop retrying, dropping any messages waiting.
+    */
+      TVoid
+   setRetry
+      (
+      TAgentKey recipient,
+      const TRetryPolicy *policy
+      )
+      {
+      if(policy)
+         {
+         retry_policies[recipient] = *policy;
+         return;
+         }
+      std::map<TAgentKey, TRetryQueue>::iterator it = retry_cache.find(recipient);
+      if(it != retry_cache.end())
+         {
+         MESSAGING_LOG_INFO("Dropped %u messages waiting to be retried", (unsigned)it->second.messages.size());
+         cancelTimer(it->second.timer);
+         retry_cache.erase(it);
+         }
+      retry_policies.erase(recipient);
+      }
+
+   /*!
+    * Retry what is waiting to be retried, waiting for the backoff in between,
+    * until nothing is left or timeoutUs have passed (in virtual time under
+    * simulate).
+    * @return The number of messages still waiting.
+    */
+      size_t
+   drainRetries
+      (
+      Ts64 timeoutUs
+      )
+      {
+      Ts64 until = timerNowUs() + timeoutUs;
+      for(;;)
+         {
+         runTimers();
+         if(retry_cache.empty())
+            return 0;
+         Ts64 waitUs = getNextTimer();
+         if(waitUs == -1 || timerNowUs() + waitUs > until)
+            break;
+         if(g_simulating)
+            advance(waitUs);
+         else
+            usleep(waitUs);
+         }
+      size_t waiting = 0;
+      std::map<TAgentKey, TRetryQueue>::iterator it;
+      for(it = retry_cache.begin(); it != retry_cache.end(); it++)
+         waiting += it->second.messages.size();
+      return waiting;
+      }
+
+   /*!
+    * @return The number of messages to recipient waiting to be retried.
+    */
+      size_t
+   getRetryCount
+      (
+      TAgentKey recipient
+      )
+      {
+      std::map<TAgentKey, TRetryQueue>::iterator it = retry_cache.find(recipient);
+      return it == retry_cache.end() ? 0 : it->second.messages.size();
+      }
+
+   /*!
+    * Send header with segments appended as fields, copying each value only
+    * once: over a socket the values go straight to the kernel (writev), and
+    * otherwise into the message that goes into the queue. header is left as
+    * it was.
+    */
+      TSendResult
+   sendSegments
+      (
+      TMsg *header,
+      const TSegment *segments,
+      size_t count
+      )
+      {
+      size_t bodySize = header->_bodySize;
+      for(size_t i = 0; i < count; i++)
+         bodySize += sizeof(segments[i].rkey) + sizeof(segments[i].length) + segments[i].length;
+      // the same bound as TMsg::reserve, which the copy below goes through
+      if(bodySize >= getMaxBodySize(header->getRecipient()))
+         {
+         MESSAGING_LOG_ERROR("Message size (%u bytes) exceeds maximum limit! Not sending.", bodySize);
+         return SEND_INVALID;
+         }
+
+      TAgentKey recipient = header->getRecipient();
+      const TRouteNode *node = NULL;
+      // straight to the socket only if the message needs nothing else done to
+      // it on the way: retries, credits, the journal or holding back
+      if(count < SEGMENTS_MAX && msg::descriptor_cache.count(header->getSender()) &&
+            route(recipient) == NOT_AN_AGENT && !retry_policies.count(recipient) &&
+            !credit_cache.count(recipient) && !journal_cache.count(recipient) &&
+            !held_cache.count(recipient))
+         node = findRoute(recipient);
+      if(node && !node->address.empty())
+         {
+         struct iovec iov[1 + 2*SEGMENTS_MAX];
+         Tn8 prefixes[SEGMENTS_MAX][sizeof(TResourceKey) + sizeof(size_t)];
+         size_t headerBodySize = header->_bodySize;
+         header->_bodySize = bodySize;
+         iov[0].iov_base = header;
+         iov[0].iov_len = headerBodySize + sizeof(TMsg) - MESSAGE_BODY_MEM_SIZE;
+         for(size_t i = 0; i < count; i++)
+            {
+            memcpy(prefixes[i], &segments[i].rkey, sizeof(TResourceKey));
+            memcpy(prefixes[i] + sizeof(TResourceKey), &segments[i].length, sizeof(size_t));
+            iov[1 + 2*i].iov_base = prefixes[i];
+            iov[1 + 2*i].iov_len = sizeof(prefixes[i]);
+            iov[2 + 2*i].iov_base = (TVoid *)segments[i].value;
+            iov[2 + 2*i].iov_len = segments[i].length;
+            }
+         TSendResult result = deliverSocket(header->getSender(), recipient, iov, 1 + 2*count, node->address);
+         header->_bodySize = headerBodySize;
+         return result;
+         }
+
+      TMsgHandle whole;
+      memcpy(whole.get(), header, header->_bodySize + sizeof(TMsg) - MESSAGE_BODY_MEM_SIZE);
+      for(size_t i = 0; i < count; i++)
+         {
+         Tn8 *value = whole->reserve(segments[i].rkey, segments[i].length);
+         if(value == NULL)
+            return SEND_INVALID;
+         memcpy(value, segments[i].value, segments[i].length);
+         }
+      return sendOrRetry(whole.get(), NULL);
+      }
+
+   /*!
+    * Put our messages to recipient under credit-based flow control: each one
+    * uses a credit and none are sent without one (SEND_NO_CREDIT) until the
+    * recipient grants more with grantCredits.
+    */
+      TVoid
+   setCredits
+      (
+      TAgentKey recipient,
+      size_t credits
+      )
+      {
+      credit_cache[recipient] = credits;
+      }
+
+      TVoid
+   clearCredits
+      (
+      TAgentKey recipient
+      )
+      {
+      credit_cache.erase(recipient);
+      }
+
+      size_t
+   getCredits
+      (
+      TAgentKey recipient
+      )
+      {
+      std::map<TAgentKey, size_t>::iterator it = credit_cache.find(recipient);
+      return it == credit_cache.end() ? 0 : it->second;
+      }
+
+   /*!
+    * Let producer send us credits more messages. The producer applies the
+    * grant with acceptCredit.
+    */
+      Ts32
+   grantCredits
+      (
+      TAgentKey me,
+      TAgentKey producer,
+      size_t credits
+      )
+      {
+      TMsg grant(REST_ACK);
+      grant.setSender(me);
+      grant.setRecipient(producer);
+      grant.append(RESOURCE_CREDIT, sizeof(credits), &credits);
+      return send(&grant);
+      }
+
+   /*!
+    * Apply a grant made with grantCredits. A grant from an agent we did not
+    * setCredits for is ignored, so it cannot turn credits on by itself.
+    * @return TRUE if the message was one, i.e. there is nothing else in it.
+    */
+      TBoolean
+   acceptCredit
+      (
+      TMsg *grant
+      )
+      {
+      size_t credits;
+      if(grant->getResourceKey(0) != RESOURCE_CREDIT || grant->getFieldSize(0) != sizeof(credits))
+         return FALSE;
+      memcpy(&credits, grant->getFieldPointer(0), sizeof(credits));
+      std::map<TAgentKey, size_t>::iterator it = credit_cache.find(grant->getSender());
+      if(it != credit_cache.end())
+         it->second += credits;
+      return TRUE;
+      }
+
+   /*!
+    * Keep every message sent to agent by this process in a journal in
+    * directory until agent acknowledges it, so that replay can deliver again
+    * whatever was lost with the queue, e.g. to a restart. The agent's own
+    * process must do the same to acknowledge and replay. A message that could
+    * not be put in the queue is taken back out of the journal. Journaled
+    * messages are synced to disk in groups, and within JOURNAL_COMMIT_US at
+    * the latest as timers go off (see runTimers).
+    * @param directory NULL to stop journaling.
+    */
+      Ts32
+   setPersistent
+      (
+      TAgentKey agent,
+      Tnc8 *directory
+      )
+      {
+      std::map<TAgentKey, journal::TJournal *>::iterator it = journal_cache.find(agent);
+      if(it != journal_cache.end())
+         {
+         journal::close(it->second);
+         journal_cache.erase(it);
+         }
+      if(commit_timers.count(agent))
+         {
+         cancelTimer(commit_timers[agent]);
+         commit_timers.erase(agent);
+         }
+      if(directory == NULL)
+         return SUCCESS;
+      if(!isKnownAgent(agent))
+         {
+         MESSAGING_LOG_ERROR("Invalid key");
+         return FAILURE;
+         }
+
+      journal::TJournal *j = journal::open(directory, getPath(agent));
+      if(j == NULL)
+         return FAILURE;
+      journal_cache[agent] = j;
+      return SUCCESS;
+      }
+
+   /*!
+    * Make sure every message journaled so far for agent is on disk, rather
+    * than waiting for the group commit.
+    */
+      TVoid
+   syncPersistent
+      (
+      TAgentKey agent
+      )
+      {
+      if(journal_cache.count(agent))
+         journal::commit(journal_cache[agent]);
+      }
+
+   /*!
+    * Tell the journal that message, and everything before it, needn't be
+    * replayed. For agents made persistent with setPersistent.
+    */
+      Ts32
+   acknowledge
+      (
+      TMsg *message
+      )
+      {
+      std::map<TAgentKey, journal::TJournal *>::iterator it = journal_cache.find(message->getRecipient());
+      if(it == journal_cache.end())
+         return FAILURE;
+
+      size_t iBody = 0;
+      size_t last = 0;
+      for(; iBody < message->getBodySize(); iBody = message->getNextFieldOffset(iBody))
+         last = iBody;
+      Ts64 sequence;
+      if(message->getResourceKey(last) != RESOURCE_JOURNAL || message->getFieldSize(last) != sizeof(sequence))
+         {
+         MESSAGING_LOG_ERROR("Message was not journaled");
+         return FAILURE;
+         }
+      memcpy(&sequence, message->getFieldPointer(last), sizeof(sequence));
+      journal::acknowledge(it->second, sequence);
+      return SUCCESS;
+      }
+
+      static TBoolean
+   redeliver
+      (
+      const TVoid *record,
+      size_t length,
+      TVoid *context
+      )
+      {
+      TMsg message;
+      if(length > sizeof(message))
+         return TRUE; // not one of ours, skip it
+      memcpy(&message, record, length);
+      TAgentKey via = route(message.getRecipient());
+      if(via == NOT_AN_AGENT)
+         return TRUE;
+      *(size_t *)context += SUCCESS == deliver(&message, via);
+      return TRUE;
       }
 
-      TAgentKey
-   createAgent
+   /*!
+    * Put every message for agent that was journaled but not acknowledged
+    * back in its queue, e.g. after a restart.
+    * @return The number of messages delivered.
+    */
+      size_t
+   replay
       (
-      Tnc8 *path,
-      mq_attr *attr
+      TAgentKey agent
       )
       {
-      mqd_t mqd = -1;
+      size_t delivered = 0;
+      if(journal_cache.count(agent))
+         journal::replay(journal_cache[agent], redeliver, &delivered);
+      return delivered;
+      }
 
-      MESSAGING_LOG_INFO("Allocating message queue at '%s'", path);
-      MESSAGING_LOG_INFO("Maximum number of messages for '%s': %ld", path, attr->mq_maxmsg);
-      MESSAGING_LOG_INFO("Maximum size of messages for '%s': %ld", path, attr->mq_msgsize);
+   /*!
+    * Keep recipient among those forward has open, closing the least recently
+    * used beyond FORWARD_OPEN_MAX.
+    */
+      static TVoid
+   touchForwarded
+      (
+      TAgentKey recipient
+      )
+      {
+      std::list<TAgentKey>::iterator it = std::find(forward_opened.begin(), forward_opened.end(), recipient);
+      if(it == forward_opened.end())
+         return;
+      forward_opened.splice(forward_opened.end(), forward_opened, it);
+      }
 
-      attr->mq_flags |= O_EXCL | O_RDWR;
-#ifndef SOLIPSISM
-      mqd = mq_open(path, attr->mq_flags | O_CREAT, S_IRUSR | S_IWUSR, attr);
-#else
-      mqd = solip_imqd++;
-#endif
-      if (-1 != mqd)
-         {
-         MESSAGING_LOG_INFO("Created new message queue");
-         goto success;
-         }
-      else if(EEXIST != errno)
+      static TVoid
+   closeForwarded()
+      {
+      while(forward_opened.size() > FORWARD_OPEN_MAX)
          {
-         MESSAGING_LOG_POSIX_ERROR;
-         return -1;
+         TAgentKey oldest = forward_opened.front();
+         forward_opened.pop_front();
+         std::map<TAgentKey, mqd_t>::iterator it = msg::descriptor_cache.find(oldest);
+         if(it == msg::descriptor_cache.end())
+            continue;
+         if(!g_simulating)
+            mq_close(it->second);
+         msg::descriptor_cache.erase(it);
+         msg::attribute_cache.erase(oldest);
+         route_cache.erase(oldest);
          }
+      }
 
-#ifndef SOLIPSISM //Note: This code is unreachable with solipsism
-      mqd = mq_open(path, attr->mq_flags, S_IRUSR | S_IWUSR, attr);
-#endif
-      if(-1 != mqd)
-         MESSAGING_LOG_INFO("Used existing message queue");
-      else
+   /*!
+    * Open the queue of recipient for forward, if there is one. A gateway
+    * creates neither queues nor names, so a message for an agent that does
+    * not exist cannot leave a stray queue behind.
+    */
+      static TBoolean
+   openForwarded
+      (
+      TAgentKey recipient
+      )
+      {
+      // simulated agents are all open already
+      Tnc8 *path = getPath(recipient);
+      if(g_simulating || *path == '\0')
+         return FALSE;
+      mqd_t mqd = mq_open(path, O_WRONLY);
+      if(-1 == mqd)
+         return FALSE;
+      mq_attr attr;
+      if(0 != mq_getattr(mqd, &attr))
          {
-         MESSAGING_LOG_ERROR("Something dreadful happened!");
          MESSAGING_LOG_POSIX_ERROR;
-         return -1;
+         mq_close(mqd);
+         return FALSE;
          }
-
-      success:
-      TAgentKey key = computeAgentKey(path);
-      //MESSAGING_LOG_INFO("key = %u", key);
-      msg::attribute_cache[key] = *attr;
-      msg::special_flags[key] = 0;
-      msg::agent_names[key] = path;
-      msg::descriptor_cache[key] = mqd;
-      msg::agent_key_cache[path] = key;
-      //MESSAGING_LOG_INFO("Success");
-      return key;
+      attr.mq_flags = 0;
+      msg::attribute_cache[recipient] = attr;
+      msg::descriptor_cache[recipient] = mqd;
+      route_cache.erase(recipient);
+      forward_opened.push_back(recipient);
+      closeForwarded();
+      return TRUE;
       }
 
-      TAgentKey
-   createAgent
+   /*!
+    * Pass on a message received by a gateway (see addRoute). Unlike send, the
+    * sender need not be one of ours. The recipient's queue is opened on first
+    * use, if it exists, and closed again once FORWARD_OPEN_MAX others have
+    * been used since; failing that the message goes by the recipient's
+    * route, if it has one.
+    * @return FAILURE for a recipient with neither.
+    * @param gateway The agent the message was received by, so that it is
+    * not handed back to it, e.g. when the recipient cannot be opened.
+    */
+      Ts32
+   forward
       (
-      Tnc8 *path,
-      size_t max_msg_count,
-      size_t max_msg_size, /* in bytes */
-      TBoolean blocking
+      TMsg *message,
+      TAgentKey gateway
       )
       {
-      mq_attr attr;
-      mq_attr max_attr;
-      attr.mq_maxmsg = max_msg_count;
-      attr.mq_msgsize = max_msg_size;
-      attr.mq_flags = 0;
-      if(!blocking)
-         {
-         attr.mq_flags |= O_NONBLOCK;
-         }
+      TAgentKey recipient = message->getRecipient();
+      if(!msg::descriptor_cache.count(recipient))
+         openForwarded(recipient);
+      touchForwarded(recipient);
 
-      if(attr.mq_msgsize > MESSAGE_BODY_MEM_SIZE)
+      TAgentKey via = route(recipient);
+      if(via == NOT_AN_AGENT)
          {
-         MESSAGING_LOG_ERROR("Argued body size (%ld) is larger than static memory allocation (%u).", attr.mq_msgsize, MESSAGE_BODY_MEM_SIZE);
-         return -1;
+         const TRouteNode *node = findRoute(recipient);
+         if(node && !node->address.empty())
+            return SEND_OK == deliverSocket(message, node->address) ? SUCCESS : FAILURE;
+         MESSAGING_LOG_ERROR("No agent '%s' to forward to", getPath(recipient));
+         return FAILURE;
          }
-
-      getMaxAttributes(&max_attr);
-      if(attr.mq_maxmsg <= max_attr.mq_maxmsg && attr.mq_msgsize <= max_attr.mq_msgsize)
-         return createAgent(path, &attr);
-      else
+      if(via == message->getSender() || via == gateway)
          {
-         MESSAGING_LOG_ERROR("Argued value(s) larger than soft-maximum");
-         return -1;
+         MESSAGING_LOG_ERROR("Routing loop at '%s'", getPath(via));
+         return FAILURE;
          }
+      MESSAGING_LOG_INFO("forwarding message: '%s' ===> '%s'", getPath(message->getSender()), getPath(recipient));
+      return deliver(message, via);
       }
 
    /*!
-    * Create a new key and associated facility for sending/receiving messages.
-    *
-    * @return The key
-    * @retval -1 Error
+    * @param pattern Either a name or a prefix followed by '*', e.g. "outPort*".
     */
-      TAgentKey
-   createAgent(Tnc8 *path)
+      static TBoolean
+   matchesPattern
+      (
+      const std::string &name,
+      Tnc8 *pattern
+      )
       {
-      mq_attr attr;
-
-      getMaxAttributes(&attr);
-      attr.mq_flags = 0;
-      return createAgent(path, &attr);
+      size_t l = strlen(pattern);
+      if(l > 0 && pattern[l - 1] == '*')
+         return name.compare(0, l - 1, pattern, l - 1) == 0;
+      return name.compare(pattern) == 0;
       }
 
-      TAgentKey
-   getAgentKey
+   /*!
+    * Have everything published about resource rk delivered to subscriber.
+    */
+      TVoid
+   subscribe
       (
-      Tnc8 *path
+      TAgentKey subscriber,
+      TResourceKey rk
       )
       {
-      return agent_key_cache[path];
+      subscriptions[rk].insert(subscriber);
       }
 
-      Ts32
-   destroyAgent(Tnc8 *agentName)
+   /*!
+    * Subscribe to every resource whose name matches pattern (see
+    * matchesPattern).
+    * @return The number of resources subscribed to.
+    */
+      size_t
+   subscribe
+      (
+      TAgentKey subscriber,
+      Tnc8 *pattern
+      )
       {
-      TAgentKey key = computeAgentKey(agentName);
-      if(msg::descriptor_cache.count(key));
-         if(mq_close(msg::descriptor_cache[key]) != 0)
-            return FAILURE;
-      if(mq_unlink(agentName) == 0)
+      std::vector<TResourceKey> matched;
+      lockNames();
+      std::map<TResourceKey, std::string>::iterator it;
+      for(it = resource_names.begin(); it != resource_names.end(); it++)
          {
-         msg::attribute_cache.erase(msg::attribute_cache.find(key));
-         msg::special_flags.erase(msg::special_flags.find(key));
-         msg::received_cache.erase(msg::received_cache.find(key));
-         msg::agent_names.erase(msg::agent_names.find(key));
-         msg::descriptor_cache.erase(msg::descriptor_cache.find(key));
-         return SUCCESS;
+         if(matchesPattern(it->second, pattern))
+            matched.push_back(it->first);
          }
-      return FAILURE;
-      }
-
-      TResourceKey
-   createResource(Tnc8 *name)
-      {
-      TResourceKey key = computeResourceKey(name);
-      resource_key_cache[name] = key;
-      return key;
+      unlockNames();
+      for(size_t i = 0; i < matched.size(); i++)
+         subscribe(subscriber, matched[i]);
+      return matched.size();
       }
 
-      TResourceKey
-   getResourceKey(Tnc8 *name)
+      TVoid
+   unsubscribe
+      (
+      TAgentKey subscriber,
+      TResourceKey rk
+      )
       {
-      return msg::resource_key_cache[name];
+      if(subscriptions.count(rk))
+         {
+         subscriptions[rk].erase(subscriber);
+         if(subscriptions[rk].empty())
+            subscriptions.erase(rk);
+         }
       }
 
-      Tnc8*
-   getResourceName
+   /*!
+    * Ask the publisher, which may live in another process, to (un)subscribe
+    * subscriber to every resource matching pattern, including those it
+    * creates after the request. The pattern itself is sent and the publisher
+    * keeps it (see acceptSubscription).
+    * @return FAILURE if pattern is empty or too long to send.
+    */
+      Ts32
+   requestSubscription
       (
-      TResourceKey key
+      TAgentKey subscriber,
+      TAgentKey publisher,
+      Tnc8 *pattern,
+      TBoolean subscribing
       )
       {
-      return resource_names[key].c_str();
+      if(!pattern || !*pattern)
+         return FAILURE;
+      TMsg request(subscribing ? REST_CREATE : REST_DELETE);
+      request.setSender(subscriber);
+      request.setRecipient(publisher);
+      request.append(subscribing ? RESOURCE_SUBSCRIBE : RESOURCE_UNSUBSCRIBE, strlen(pattern), pattern);
+      if(!request.isValid())
+         return FAILURE;
+      return send(&request);
       }
 
-      static TMsg *
-   receive
+   /*!
+    * Apply a subscription request made with requestSubscription. Its
+    * patterns are matched against resource names each time something is
+    * published, so they also cover resources created afterwards.
+    * @return TRUE if the message was one, i.e. there is nothing else in it.
+    */
+      TBoolean
+   acceptSubscription
       (
-      TAgentKey key,
-      timespec* pTimeout
+      TMsg *request
       )
       {
+      TResourceKey field = request->getResourceKey(0);
+      if(field != RESOURCE_SUBSCRIBE && field != RESOURCE_UNSUBSCRIBE)
+         return FALSE;
+
+      size_t iBody;
+      for(iBody = 0; iBody < request->getBodySize(); iBody = request->getNextFieldOffset(iBody))
          {
-         unsigned int priority;
-         TMsg message;
-         //MESSAGING_LOG_INFO("Attempting to receive message for %s", msg::agent_names[key].c_str());
-#ifndef SOLIPSISM
-         Ts32 mq_result;
-         if(pTimeout)
-            {
-            mq_result = mq_timedreceive (
-                  msg::descriptor_cache[key],
-                  (char*)&message,
-                  msg::attribute_cache[key].mq_msgsize,
-                  &priority,
-                  pTimeout);
-            if(-1 == mq_result)
-               {
-               if(errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT)
-                  {
-                  MESSAGING_LOG_POSIX_ERROR;
-                  }
-               return NULL;
-               }
-            }
-         else
+         std::string pattern(request->getFieldPointer(iBody), request->getFieldSize(iBody));
+         if(pattern.empty())
+            continue;
+         if(request->getResourceKey(iBody) == RESOURCE_SUBSCRIBE)
+            pattern_subscriptions[pattern].insert(request->getSender());
+         else if(request->getResourceKey(iBody) == RESOURCE_UNSUBSCRIBE && pattern_subscriptions.count(pattern))
             {
-            mq_result = mq_receive (
-                  msg::descriptor_cache[key],
-                  (char*)&message,
-                  msg::attribute_cache[key].mq_msgsize,
-                  &priority);
+            pattern_subscriptions[pattern].erase(request->getSender());
+            if(pattern_subscriptions[pattern].empty())
+               pattern_subscriptions.erase(pattern);
             }
-//         MESSAGING_LOG_INFO("Receiving message for '%s'", agent_names[key].c_str());
-         msg::received_cache[key].push_back(message);
-#endif
-         MESSAGING_LOG_INFO("Received message: '%s' ===> '%s'", agent_names[message.getSender()].c_str(), agent_names[key].c_str());
-         return &msg::received_cache[key].back();
          }
-      MESSAGING_LOG_ERROR("Invalid key");
-      return NULL;
+      return TRUE;
       }
 
-      TMsg *
-   receive
+   /*!
+    * Deliver message to every agent subscribed to any of the resources in
+    * it, except its sender. The message is built once and only its recipient
+    * changes from one delivery to the next, so it should be built with the
+    * recipient left as NOT_AN_AGENT and without per-recipient representation.
+    * @return The number of subscribers it was delivered to.
+    */
+      size_t
+   publish
       (
-      TAgentKey key
+      TMsg *message
       )
       {
-      struct timespec timeout;
-      timeout.tv_nsec = 50;
-      timeout.tv_sec = 0;
-      return receive(key, &timeout);
-      }
+      std::set<TAgentKey> recipients;
+      size_t iBody;
+      for(iBody = 0; iBody < message->getBodySize(); iBody = message->getNextFieldOffset(iBody))
+         {
+         TResourceKey rk = message->getResourceKey(iBody);
+         std::map<TResourceKey, std::set<TAgentKey> >::iterator it = subscriptions.find(rk);
+         if(it != subscriptions.end())
+            recipients.insert(it->second.begin(), it->second.end());
+         if(pattern_subscriptions.empty())
+            continue;
+         std::string name = getResourceName(rk);
+         std::map<std::string, std::set<TAgentKey> >::iterator ip;
+         for(ip = pattern_subscriptions.begin(); ip != pattern_subscriptions.end(); ip++)
+            {
+            if(matchesPattern(name, ip->first.c_str()))
+               recipients.insert(ip->second.begin(), ip->second.end());
+            }
+         }
+      recipients.erase(message->getSender());
 
-      TMsg *
-   blockingReceive
-      (
-      TAgentKey key
-      )
-      {
-      return receive(key, NULL);
+      size_t count = 0;
+      TAgentKey originalRecipient = message->getRecipient();
+      std::set<TAgentKey>::iterator it;
+      for(it = recipients.begin(); it != recipients.end(); it++)
+         {
+         if(message->getBodySize() > getMaxBodySize(*it))
+            {
+            MESSAGING_LOG_ERROR("Message too large for subscriber '%s'", getPath(*it));
+            continue;
+            }
+         message->setRecipient(*it);
+         if(SUCCESS == send(message))
+            count++;
+         }
+      message->setRecipient(originalRecipient);
+      return count;
       }
 
-
+   /*!
+    * Send a table of any size as a sequence of messages split on row
+    * boundaries. The recipient applies each one as it arrives with
+    * TMsg::extractInto and stops after the one for which isStreamEnd() is
+    * true.
+    * @param window The most messages that may be waiting in the recipient's
+    * queue before we hold off sending more, or 0 to rely on the queue's own
+    * size alone.
+    * @param timeoutUs How long to wait for room for any one chunk, in the
+    * window or in the queue, e.g. for a recipient that stopped reading.
+    * Virtual time while simulating, see simulate.
+    * @return FAILURE if a chunk could not be sent or there was no room for it
+    * in time, or a row is too large to go in one, in which case the rows
+    * after it are not sent either.
+    */
       Ts32
-   send(TMsg *message)
+   sendTable
+      (
+      TAgentKey sender,
+      TAgentKey recipient,
+      Data::TBase &db,
+      Tnc8 *tableName,
+      Tnc8 **colNames,
+      size_t window,
+      Ts64 timeoutUs
+      )
       {
-      if(msg::descriptor_cache.count(message->getSender()))
+      size_t dbIndex = db.begin(tableName);
+      size_t sequence = 0;
+      TBoolean last = FALSE;
+      while(!last)
          {
-         if(msg::descriptor_cache.count(message->getRecipient()))
+         TMsg chunk;
+         chunk.setSender(sender);
+         chunk.setRecipient(recipient);
+         dbIndex = chunk.appendStreamFrom(db, tableName, colNames, dbIndex, sequence++);
+         if(!chunk.isValid())
             {
-            MESSAGING_LOG_INFO("sending message: '%s' ===> '%s'", agent_names[message->getSender()].c_str(), agent_names[message->getRecipient()].c_str());
-#ifndef SOLIPSISM
-//            MESSAGING_LOG_INFO("Sending %s message from '%s' to '%s'", verb_to_string(msg->verb), agent_names[msg->sender].c_str(), agent_names[msg->recipient].c_str());
-            if(-1 == mq_send(msg::descriptor_cache[message->getRecipient()], (const char*)message, message->getBodySize() + sizeof(TMsg) - MESSAGE_BODY_MEM_SIZE, 1))
+            MESSAGING_LOG_ERROR("Failed to pack chunk %u of %s", sequence - 1, tableName);
+            return FAILURE;
+            }
+         last = chunk.isStreamEnd();
+
+         Ts64 deadlineUs = timerNowUs() + timeoutUs;
+         while(window > 0 && getReceivedCount(recipient) >= window)
+            {
+            Ts64 leftUs = deadlineUs - timerNowUs();
+            if(leftUs <= 0)
                {
-               MESSAGING_LOG_POSIX_ERROR;
+               MESSAGING_LOG_ERROR("No room for chunk %u of %s in time", sequence - 1, tableName);
                return FAILURE;
                }
-#else
-            // Put the message directly into the receiver's list since the
-            // sender and receiver are one in the mind of a solipsist.
-            msg::received_cache[message->getRecipient()].push_back(message);
-#endif
-            return SUCCESS;
+            if(g_simulating)
+               {
+               // the recipient only reads between our calls, so only time
+               // can pass here
+               advance(leftUs);
+               continue;
+               }
+            struct timespec backoff;
+            backoff.tv_sec = 0;
+            backoff.tv_nsec = 1000 * 1000;
+            nanosleep(&backoff, NULL);
             }
-         else
+
+         // what is left of it for room in the queue itself
+         Ts64 leftUs = deadlineUs - timerNowUs();
+         struct timespec deadline = deadlineIn(leftUs > 0 ? leftUs : 0);
+         if(SEND_OK != sendWithDeadline(&chunk, &deadline))
             {
-            MESSAGING_LOG_ERROR("Invalid recipient");
+            MESSAGING_LOG_ERROR("Failed to send chunk %u of %s", sequence - 1, tableName);
             return FAILURE;
             }
          }
-      else
-         {
-         MESSAGING_LOG_INFO("Invalid sender");
-         return FAILURE;
-         }
+      return SUCCESS;
       }
 
       size_t
    getReceivedCount(TAgentKey key)
       {
+      if(g_simulating)
+         {
+         size_t count = sim_queues.count(key) ? sim_queues[key].size() : 0;
+         if(fair_cache.count(key))
+            count += fair_cache[key].count;
+         return count;
+         }
 #ifndef SOLIPSISM
       if(msg::descriptor_cache.count(key))
          {
          mq_getattr(msg::descriptor_cache[key], &msg::attribute_cache[key]);
-         return msg::attribute_cache[key].mq_curmsgs;
+         size_t count = msg::attribute_cache[key].mq_curmsgs;
+         if(fair_cache.count(key))
+            count += fair_cache[key].count;
+         if(partition_cache.count(key))
+            {
+            std::vector<mqd_t> &queues = partition_cache[key].queues;
+            mq_attr attr;
+            for(size_t i = 0; i < queues.size(); i++)
+               if(0 == mq_getattr(queues[i], &attr))
+                  count += attr.mq_curmsgs;
+            }
+         return count;
          }
       else
          {
@@ -1222,18 +5280,27 @@ namespace msg
       {
       if(msg::attribute_cache.count(key))
          {
-         TMsg message;
          size_t count = 0;
-         ssize_t nBytes;
+         if(g_simulating)
+            count += drainSimulated(key);
 #ifndef SOLIPSISM
-         do {
-            nBytes = mq_receive(msg::descriptor_cache[key], (char *)&message, msg::attribute_cache[key].mq_msgsize, NULL); // will not block
-            count++;
+         else
+            count += drainQueue(key, msg::descriptor_cache[key]);
+         if(partition_cache.count(key))
+            {
+            std::vector<mqd_t> &queues = partition_cache[key].queues;
+            for(size_t i = 0; i < queues.size(); i++)
+               count += drainQueue(key, queues[i]);
             }
-         while (nBytes > 0);
 #endif
+         std::map<TAgentKey, TFairQueue>::iterator fair = fair_cache.find(key);
+         if(fair != fair_cache.end())
+            {
+            count += fair->second.count;
+            clearFair(fair->second);
+            }
          count += msg::received_cache[key].size();
-         msg::received_cache[key].clear();
+         recycleReceived(msg::received_cache[key], msg::received_cache[key].begin(), msg::received_cache[key].end());
          MESSAGING_LOG_INFO("Flushed %u messages", count);
          }
       else
@@ -1242,10 +5309,31 @@ namespace msg
          }
       }
 
+   /*!
+    * Forget the messages receive has returned for key, which are otherwise
+    * kept; pointers to them are no longer good.
+    */
+      TVoid
+   clearReceived(TAgentKey key)
+      {
+      std::map<TAgentKey, std::list<TMsg> >::iterator it = msg::received_cache.find(key);
+      if(it != msg::received_cache.end())
+         recycleReceived(it->second, it->second.begin(), it->second.end());
+      }
+
+   /*!
+    * Like getResourceName, the path returned stays good; destroyAgent keeps
+    * the agent's name.
+    */
       Tnc8*
    getPath(TAgentKey key)
       {
-      return msg::agent_names[key].c_str();
+      isKnownAgent(key);
+      lockNames();
+      std::map<TAgentKey, std::string>::iterator it = msg::agent_names.find(key);
+      Tnc8 *name = it != msg::agent_names.end() ? it->second.c_str() : "";
+      unlockNames();
+      return name;
       }
 
       TVoid
@@ -1273,22 +5361,34 @@ namespace msg
          mq_setattr(msg::descriptor_cache[key], &msg::attribute_cache[key], NULL);
 #endif
          }
-      msg::special_flags[key] &= !special_flags;
+      msg::special_flags[key] &= ~special_flags;
       }
 
+   /*!
+    * For an agent whose queue we have not opened, the size of the queue the
+    * message would go into on the way, i.e. its gateway's (see addRoute).
+    */
       size_t
    getMaxBodySize(TAgentKey key)
       {
-      return msg::attribute_cache[key].mq_msgsize;
+      std::map<TAgentKey, mq_attr>::iterator it = msg::attribute_cache.find(key);
+      if(it == msg::attribute_cache.end())
+         it = msg::attribute_cache.find(route(key));
+      if(it == msg::attribute_cache.end())
+         return MESSAGE_BODY_MEM_SIZE; // e.g. a message to be published, or to go over a socket
+      return it->second.mq_msgsize;
       }
 
       TResourceType
    getResourceType(TResourceKey rk)
       {
-      if(resource_types.count(rk) > 0)
-         return resource_types[rk];
-      else
+      if(!isKnownResource(rk))
          return UNKNOWN_TYPE;
+      lockNames();
+      std::map<TResourceKey, TResourceType>::iterator it = resource_types.find(rk);
+      TResourceType type = it != resource_types.end() ? it->second : UNKNOWN_TYPE;
+      unlockNames();
+      return type;
       }
    }
 
@@ -9,6 +9,8 @@
 #define MESSAGING_HPP_
 
 #include <list>
+#include <cstring>
+#include <ctime>
 #include "include/rest.h"
 #include "solib/data/data.hpp"
 #include "include/aditypes.h"
@@ -38,6 +40,13 @@ namespace msg
 
    extern const size_t FIELD_HEADER_SIZE;
 
+   /*!
+    * Special flag for setAttributes: while the agent's queue is full, a SET
+    * for it replaces a held SET about the same resources and index instead
+    * of queueing behind it. See sendHeld.
+    */
+   extern const Ts32 FLAG_COALESCE;
+
    /*!
     * for temporary backwards compat.
     */
@@ -60,6 +69,63 @@ namespace msg
       } TResourceType;
 
 
+   /*!
+    * What became of a message given to trySend or sendWithDeadline.
+    */
+   typedef enum
+      {
+      SEND_OK,
+      SEND_FULL,      // the recipient's queue had no room
+      SEND_TIMEOUT,   // the recipient's queue had no room before the deadline
+      SEND_NO_CREDIT, // see setCredits
+      SEND_INVALID,   // unknown sender or no way to reach the recipient
+      SEND_ERROR
+      } TSendResult;
+
+   /*!
+    * An IPv4 address as it goes over the wire, for TMsg::put and TMsg::get.
+    */
+   typedef struct
+      {
+      T8 octet[4];
+      } TIpv4;
+
+   /*!
+    * A field for sendSegments, its value left where it is until sent.
+    */
+   typedef struct
+      {
+      TResourceKey rkey;
+      const TVoid *value;
+      size_t length;
+      } TSegment;
+
+   /*!
+    * How the simulated transport behaves, see simulate.
+    */
+   typedef struct
+      {
+      Tu32 seed;
+      Ts64 minDelayUs;     // a message takes between these to arrive
+      Ts64 maxDelayUs;
+      Tu32 reorderPercent; // chance a message may overtake those before it
+      Tu32 fullPercent;    // chance a send finds the queue full anyway
+      size_t capacity;     // messages per agent, 0 for as created
+      } TSimulation;
+
+   /*!
+    * How send retries messages that find their recipient's queue full, see
+    * setRetry.
+    */
+   typedef struct
+      {
+      Tu32 attempts;        // retries before giving up on a message
+      Ts64 firstDelayUs;    // doubled after each failed retry...
+      Ts64 maxDelayUs;      // ...up to this
+      size_t capacity;      // messages waiting at most, 0 for no limit
+      TAgentKey deadLetter; // gets messages given up on, NOT_AN_AGENT to drop them
+      } TRetryPolicy;
+
 #define MESSAGE_BODY_MEM_SIZE 8*KB
       /*
        * Following TLV convention
@@ -88,6 +154,8 @@ namespace msg
             } _bc;
             TVoid invalidate();
             TVoid dump (size_t arbitraryStart);
+            TVoid appendRow(Data::TBase&, Tnc8 *tableName, Tnc8 **colNames, size_t dbIndex);
+            friend TSendResult sendSegments(TMsg *, const TSegment *, size_t);
       public:
                      TMsg();
                      TMsg(TRestVerb);
@@ -103,9 +171,15 @@ namespace msg
          TVoid       appendInteger(TResourceKey rkey, size_t l, Ts32 integer);
          TVoid       appendString(TResourceKey rkey, size_t l, Tnc8 *value);
          size_t      appendFrom(Data::TBase&, Tnc8 *tableName, Tnc8 **colNames);
+         size_t      appendChangesFrom(Data::TBase&, Tnc8 *tableName, Tnc8 **colNames, TResourceKey indexKey);
+         size_t      appendStreamFrom(Data::TBase&, Tnc8 *tableName, Tnc8 **colNames, size_t dbIndex, size_t sequence);
          TVoid       appendBang();
          Tn8        *reserve(TResourceKey rkey, size_t fieldLength);
          TVoid       constrict(size_t oldFieldLength, size_t fieldLength);
+         Tn8        *reserveAttachment(TResourceKey rkey, size_t length);
+         TBoolean    attach(TResourceKey rkey, size_t length, const TVoid *value);
+         const TVoid *mapAttachment(TResourceKey rkey, size_t *length);
+         TVoid       releaseAttachments();
          size_t      extract(TVoid *value, size_t fieldStart);
          Ts64        extractInteger (size_t fieldStart);
          size_t      extractString (Tn8 *str, size_t len, size_t fieldStart);
@@ -114,10 +188,103 @@ namespace msg
          Tnc8       *getFieldPointer(size_t fieldStart);
          TResourceKey getResourceKey(size_t field_start);
          TBoolean    isBang(size_t field_start);
+         ssize_t     getStreamSequence();
+         TBoolean    isStreamEnd();
          TVoid      *getValue(size_t field_start);
          ssize_t     getNextFieldOffset(size_t field_start);
          TBoolean    isValid();
          TVoid       erase();
+
+         /*!
+          * Append value as a field of exactly sizeof(T) bytes, as it is and
+          * without looking up the resource's type. Ts32 is the exception and
+          * is represented for the recipient like appendInteger.
+          */
+         template <typename T>
+         TVoid       put(TResourceKey rkey, T value)
+            {
+            append(rkey, sizeof(value), &value);
+            }
+
+         /*!
+          * The value of the field at fieldStart as a T, or T() if the field is
+          * not exactly sizeof(T) bytes. Ts32 is the exception and is
+          * represented like extractInteger.
+          */
+         template <typename T>
+         T           get(size_t fieldStart)
+            {
+            T value = T();
+            if(getFieldSize(fieldStart) == sizeof(value))
+               memcpy(&value, getFieldPointer(fieldStart), sizeof(value));
+            return value;
+            }
+      };
+
+   template <>
+   inline TVoid TMsg::put<Ts32>(TResourceKey rkey, Ts32 value)
+      {
+      appendInteger(rkey, sizeof(value), value);
+      }
+
+   template <>
+   inline Ts32 TMsg::get<Ts32>(size_t fieldStart)
+      {
+      return (Ts32)extractInteger(fieldStart);
+      }
+
+   /*!
+    * Sole owner of a TMsg drawn from a per-thread pool, to which it goes back
+    * when the handle is destroyed or sent. Like std::auto_ptr, copying a
+    * handle hands the message over and leaves the source empty:
+    *    TMsgHandle h(REST_SET);
+    *    h->append(...);
+    *    send(h); // h is empty if sent
+    */
+   class TMsgHandle
+      {
+      private:
+         mutable TMsg *_msg;
+      public:
+                     TMsgHandle();
+         explicit    TMsgHandle(TRestVerb);
+                     TMsgHandle(const TMsgHandle &);
+         TMsgHandle &operator=(const TMsgHandle &);
+                     ~TMsgHandle();
+         TMsg       *operator->() const {return _msg;}
+         TMsg       &operator*() const {return *_msg;}
+         TMsg       *get() const {return _msg;}
+         TBoolean    isEmpty() const {return _msg == NULL;}
+         TVoid       reset();
+      };
+
+   /*!
+    * Forward, bounds-checked walk over the fields of a TMsg:
+    *    for(TFieldCursor field(msg); field.valid(); field.next())
+    *       ... field.key(), field.value(), field.length() ...
+    */
+   class TFieldCursor
+      {
+      private:
+         Tnc8         *_start;
+         size_t        _end;
+         size_t        _offset;
+         TResourceKey  _key;
+         size_t        _length;
+         TBoolean      _onField;
+         TBoolean      _malformed;
+         TVoid         decode();
+      public:
+                       TFieldCursor(TMsg &);
+         TBoolean      valid();
+         TVoid         next();
+         TResourceKey  key();
+         TResourceType type();
+         TBoolean      isBang();
+         Tnc8         *value();
+         size_t        length();
+         size_t        offset();
+         TBoolean      isMalformed();
       };
 
    namespace stringify
@@ -130,6 +297,14 @@ namespace msg
 
    TVoid initialize(Tnc8 *configpath, TBoolean doRep = FALSE);
 
+   Ts32 reloadNames(Tnc8 *configpath = NULL);
+
+   size_t getNamesVersion();
+
+   Ts32 watchNames();
+
+   Ts32 checkNames();
+
    TAgentKey createAgent(Tnc8 *path);
 
    TAgentKey createAgent(Tnc8 *path, size_t max_msg_count, size_t max_msg_size, TBoolean blocking = TRUE);
@@ -138,8 +313,12 @@ namespace msg
 
    Ts32 destroyAgent(Tnc8* agentName);
 
+   TVoid releaseAttachment(const TVoid *, size_t length);
+
    TResourceKey createResource(Tnc8 *name);
 
+   TResourceKey createResource(Tnc8 *name, TResourceType type);
+
    TResourceKey getResourceKey(Tnc8 *name);
 
    Tnc8* getResourceName(TResourceKey key);
@@ -149,19 +328,125 @@ namespace msg
 
    TMsg *blockingReceive(TAgentKey);
 
+   TVoid setWaitStrategy(TAgentKey, size_t spinUs, size_t yieldUs, TBoolean adaptive = TRUE);
+
+   TMsg *waitReceive(TAgentKey);
+
+   TVoid setFairQueuing(TAgentKey, size_t quantum);
+
+   TVoid setSenderWeight(TAgentKey, TAgentKey sender, Tu32 weight);
+
+   TVoid setSenderLimit(TAgentKey, TAgentKey sender, size_t perSecond, size_t burst);
+
+   Ts32 setPartitions(TAgentKey, size_t count, TResourceKey partitionKey);
+
+   TMsg *receivePartition(TAgentKey, size_t partition, TBoolean blocking = FALSE);
+
+   Ts32 setCapture(TAgentKey, Tnc8 *path);
+
+   TVoid simulate(const TSimulation *);
+
+   Ts64 getVirtualTime();
+
+   size_t advance(Ts64 us);
+
+   size_t runSimulation();
+
    Ts32 send(TMsg *);
 
+   Ts32 send(TMsgHandle &);
+
+   TSendResult trySend(TMsg *);
+
+   TSendResult sendWithDeadline(TMsg *, const timespec *deadline);
+
+   TSendResult sendSegments(TMsg *header, const TSegment *, size_t count);
+
+   size_t sendAt(TMsg *, const timespec *when);
+
+   size_t sendAfter(TMsg *, Ts64 delayUs);
+
+   size_t sendEvery(TMsg *, Ts64 periodUs);
+
+   TBoolean cancelTimer(size_t);
+
+   size_t runTimers();
+
+   Ts64 getNextTimer();
+
+   TVoid setRetry(TAgentKey recipient, const TRetryPolicy *);
+
+   size_t getRetryCount(TAgentKey recipient);
+
+   size_t drainRetries(Ts64 timeoutUs);
+
+   TVoid setCredits(TAgentKey recipient, size_t credits);
+
+   TVoid clearCredits(TAgentKey recipient);
+
+   size_t getCredits(TAgentKey recipient);
+
+   Ts32 grantCredits(TAgentKey me, TAgentKey producer, size_t credits);
+
+   TBoolean acceptCredit(TMsg *);
+
+   Ts32 setPersistent(TAgentKey, Tnc8 *directory);
+
+   TVoid syncPersistent(TAgentKey);
+
+   Ts32 acknowledge(TMsg *);
+
+   size_t replay(TAgentKey);
+
+   Ts32 forward(TMsg *, TAgentKey gateway = NOT_AN_AGENT);
+
+   size_t sendHeld(TAgentKey recipient);
+
+   Ts32 addRoute(Tnc8 *prefix, TAgentKey gateway);
+
+   TVoid removeRoute(Tnc8 *prefix);
+
+   Ts32 addSocketRoute(Tnc8 *prefix, Tnc8 *address);
+
+   TVoid setSocketBatching(TBoolean);
+
+   TVoid flushSockets();
+
+   Ts32 listenSocket(Tnc8 *address);
+
+   size_t pollSockets(Ts32 timeoutMs);
+
+   TVoid subscribe(TAgentKey subscriber, TResourceKey);
+
+   size_t subscribe(TAgentKey subscriber, Tnc8 *pattern);
+
+   TVoid unsubscribe(TAgentKey subscriber, TResourceKey);
+
+   Ts32 requestSubscription(TAgentKey subscriber, TAgentKey publisher, Tnc8 *pattern, TBoolean subscribing = TRUE);
+
+   TBoolean acceptSubscription(TMsg *);
+
+   size_t publish(TMsg *);
+
+   TVoid commitChanges(TAgentKey recipient, Tnc8 *tableName);
+
+   TVoid resync(TAgentKey recipient, Tnc8 *tableName);
+
+   Ts32 sendTable(TAgentKey sender, TAgentKey recipient, Data::TBase&, Tnc8 *tableName, Tnc8 **colNames, size_t window = 0, Ts64 timeoutUs = 1000000);
+
    size_t getReceivedCount(TAgentKey);
 
    size_t getCachedCount(TAgentKey key);
 
    TVoid flush(TAgentKey);
 
+   TVoid clearReceived(TAgentKey);
+
    Tnc8 *getPath(TAgentKey);
 
-   TVoid setAttributes(TAgentKey, Ts32 flags);
+   TVoid setAttributes(TAgentKey, Ts32 flags, Ts32 special_flags = 0);
 
-   TVoid unsetAttributes(TAgentKey, long flags);
+   TVoid unsetAttributes(TAgentKey, Ts32 flags, Ts32 special_flags = 0);
 
    size_t getMaxBodySize(TAgentKey);
 
@@ -0,0 +1,187 @@
+/*
+ * messaging_capture.cpp
+ *
+ * Record the traffic of agents to a capture file and play it back:
+ *
+ *    messaging_capture record <file> <agent> [seconds]
+ *       Stand in for agent, recording whatever is sent to it. Agents that are
+ *       running can instead be captured in place by starting them with
+ *       DUMBWAITER_CAPTURE=<file> (see msg::setCapture).
+ *    messaging_capture replay <file> [speed] [agent ...]
+ *       Send the messages again, to the given agents only if any. speed is a
+ *       multiple of the original pace, 1 by default, or "max" for as fast as
+ *       possible.
+ *    messaging_capture dump <file>
+ *
+ * Keys are not translated, so replay with the same names.conf as was used
+ * to capture.
+ *
+ *  Created on: Oct 19, 2026
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <set>
+#include <string>
+
+#include "messaging.hpp"
+#include "capture.hpp"
+#include "log.hpp"
+
+typedef struct
+   {
+   double speed; // 0 for as fast as possible
+   std::set<msg::TAgentKey> recipients; // empty for all
+   std::set<msg::TAgentKey> opened;
+   Ts64 firstUs;
+   struct timespec start;
+   size_t sent;
+   size_t failed;
+   Ts64 maxLagUs;
+   } TReplay;
+
+   static Ts64
+elapsedUs(const struct timespec *since)
+   {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (Ts64)(now.tv_sec - since->tv_sec) * 1000000 + (now.tv_nsec - since->tv_nsec) / 1000;
+   }
+
+   static TVoid
+openAgent(TReplay *replay, msg::TAgentKey agent)
+   {
+   if(replay->opened.insert(agent).second)
+      msg::createAgent(msg::getPath(agent));
+   }
+
+   static TBoolean
+replayRecord(const msg::capture::TRecordHeader *header, const TVoid *record, TVoid *context)
+   {
+   TReplay *replay = (TReplay *)context;
+   msg::TMsg message;
+   memcpy(&message, record, header->length < sizeof(message) ? header->length : sizeof(message));
+   if(!replay->recipients.empty() && !replay->recipients.count(message.getRecipient()))
+      return TRUE;
+
+   if(replay->sent + replay->failed == 0)
+      {
+      replay->firstUs = header->timeUs;
+      clock_gettime(CLOCK_MONOTONIC, &replay->start);
+      }
+   else if(replay->speed > 0)
+      {
+      Ts64 dueUs = (Ts64)((header->timeUs - replay->firstUs) / replay->speed);
+      Ts64 lagUs = elapsedUs(&replay->start) - dueUs;
+      if(lagUs < 0)
+         {
+         struct timespec pause;
+         pause.tv_sec = -lagUs / 1000000;
+         pause.tv_nsec = (-lagUs % 1000000) * 1000;
+         nanosleep(&pause, NULL);
+         }
+      else if(lagUs > replay->maxLagUs)
+         replay->maxLagUs = lagUs;
+      }
+
+   openAgent(replay, message.getSender());
+   openAgent(replay, message.getRecipient());
+   if(SUCCESS == msg::send(&message))
+      replay->sent++;
+   else
+      replay->failed++;
+   return TRUE;
+   }
+
+   static TBoolean
+dumpRecord(const msg::capture::TRecordHeader *header, const TVoid *record, TVoid *context)
+   {
+   msg::TMsg message;
+   memcpy(&message, record, header->length < sizeof(message) ? header->length : sizeof(message));
+   Ts64 firstUs = *(Ts64 *)context;
+   if(firstUs == 0)
+      *(Ts64 *)context = firstUs = header->timeUs;
+   printf("%10.6f %-12s %s ===> %s (%u bytes)\n",
+         (header->timeUs - firstUs) / 1e6,
+         msg::stringify::getVerb(message.getVerb()),
+         msg::getPath(message.getSender()),
+         msg::getPath(message.getRecipient()),
+         (unsigned)message.getBodySize());
+   return TRUE;
+   }
+
+   static TVoid
+usage(Tnc8 *name)
+   {
+   printf("usage: %s record <file> <agent> [seconds]\n", name);
+   printf("       %s replay <file> [speed|max] [agent ...]\n", name);
+   printf("       %s dump <file>\n", name);
+   }
+
+int main(int argc, char *argv[])
+   {
+   if(argc < 3)
+      {
+      usage(argv[0]);
+      return 1;
+      }
+   msg::initialize();
+
+   Tnc8 *mode = argv[1];
+   Tnc8 *file = argv[2];
+   if(strcmp(mode, "record") == 0 && argc >= 4)
+      {
+      msg::TAgentKey me = msg::createAgent(argv[3]);
+      Ts64 durationUs = argc >= 5 ? (Ts64)(atof(argv[4]) * 1000000) : 0;
+      if(me == (msg::TAgentKey)-1 || SUCCESS != msg::setCapture(me, file))
+         return 1;
+      struct timespec start;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      size_t count = 0;
+      while(durationUs == 0 || elapsedUs(&start) < durationUs)
+         {
+         if(msg::receive(me))
+            count++;
+         msg::clearReceived(me);
+         }
+      printf("recorded %u messages to %s\n", (unsigned)count, file);
+      }
+   else if(strcmp(mode, "replay") == 0)
+      {
+      TReplay replay;
+      replay.speed = 1;
+      replay.firstUs = 0;
+      replay.sent = 0;
+      replay.failed = 0;
+      replay.maxLagUs = 0;
+      int arg = 3;
+      if(arg < argc && argv[arg][0] != '/')
+         {
+         replay.speed = strcmp(argv[arg], "max") == 0 ? 0 : atof(argv[arg]);
+         arg++;
+         }
+      for(; arg < argc; arg++)
+         replay.recipients.insert(msg::getAgentKey(argv[arg]));
+
+      if(-1 == msg::capture::replay(file, replayRecord, &replay))
+         return 1;
+      double seconds = replay.sent + replay.failed ? elapsedUs(&replay.start) / 1e6 : 0;
+      printf("replayed %u messages (%u failed) in %.3f s, %.0f messages/s, at most %.3f ms behind\n",
+            (unsigned)replay.sent, (unsigned)replay.failed, seconds,
+            seconds > 0 ? replay.sent / seconds : 0.0, replay.maxLagUs / 1e3);
+      }
+   else if(strcmp(mode, "dump") == 0)
+      {
+      Ts64 firstUs = 0;
+      if(-1 == msg::capture::replay(file, dumpRecord, &firstUs))
+         return 1;
+      }
+   else
+      {
+      usage(argv[0]);
+      return 1;
+      }
+   return 0;
+   }
@@ -1,31 +1,315 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
+#include <algorithm>
 #include <map>
 #include <string>
+#include <vector>
 
-#include "common.hpp"
+#include "messaging.hpp"
 #include "log.hpp"
 
-   msg::TVerb
+   TRestVerb
 parseVerb(Tnc8 *verb)
    {
    if(strcmp(verb, "create") == 0)
       {
-      return msg::VERB_CREATE;
+      return REST_CREATE;
       }
    else if(strcmp(verb, "delete") == 0)
       {
-      return msg::VERB_DELETE;
+      return REST_DELETE;
       }
    else if(strcmp(verb, "get") == 0)
       {
-      return msg::VERB_GET;
+      return REST_GET;
       }
    else if(strcmp(verb, "set") == 0)
       {
-      return msg::VERB_SET;
+      return REST_SET;
       }
-   return msg::VERB_ACK;
+   return REST_ACK;
+   }
+
+/*
+ * Load generation: "messaging_test load" sends a configurable stream of
+ * messages and "messaging_test sink" receives it, each reporting throughput
+ * and latency percentiles. Every message carries the time it was sent in a
+ * loadSentUs field so the sink can tell how long it took to arrive.
+ */
+
+typedef struct
+   {
+   TRestVerb verb;
+   size_t weight;
+   } TVerbWeight;
+
+typedef struct
+   {
+   double rate; // messages per second, over all senders; 0 for no limit
+   size_t concurrency;
+   double duration;
+   std::vector<std::string> targets;
+   std::vector<TVerbWeight> mix;
+   size_t totalWeight;
+   size_t minFields, maxFields;
+   size_t minSize, maxSize;
+   } TLoad;
+
+   static Ts64
+nowUs()
+   {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (Ts64)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+   }
+
+   static TVoid
+parseRange(Tnc8 *arg, size_t *min, size_t *max)
+   {
+   Tn8 *end;
+   *min = *max = strtoul(arg, &end, 10);
+   if(*end == '-')
+      *max = strtoul(end + 1, NULL, 10);
+   if(*max < *min)
+      *max = *min;
+   }
+
+   static TVoid
+split(Tnc8 *list, std::vector<std::string> *items)
+   {
+   std::string all(list);
+   size_t start = 0;
+   while(start <= all.size())
+      {
+      size_t comma = all.find(',', start);
+      if(comma == std::string::npos)
+         comma = all.size();
+      if(comma > start)
+         items->push_back(all.substr(start, comma - start));
+      start = comma + 1;
+      }
+   }
+
+   static TVoid
+report(Tnc8 *what, std::vector<Ts64> &latencies, size_t count, double seconds)
+   {
+   printf("%s %u messages in %.3f s: %.0f messages/s\n", what, (unsigned)count, seconds, seconds > 0 ? count / seconds : 0.0);
+   if(latencies.empty())
+      return;
+   std::sort(latencies.begin(), latencies.end());
+   const double percentiles[] = {0.5, 0.9, 0.99, 0.999};
+   printf("latency (us):");
+   for(size_t i = 0; i < sizeof(percentiles)/sizeof(*percentiles); i++)
+      {
+      size_t at = (size_t)(percentiles[i] * latencies.size());
+      printf(" p%g %ld", percentiles[i] * 100, (long)latencies[at < latencies.size() ? at : latencies.size() - 1]);
+      }
+   printf(" max %ld\n", (long)latencies.back());
+   }
+
+/*
+ * One sender: its own agent, its share of the rate, its own random stream.
+ * Send latencies (the time spent in msg::send, which grows as the targets
+ * back up) go back to the parent through fd.
+ */
+   static TVoid
+generate(const TLoad &load, size_t id, int fd)
+   {
+   Tn8 path[32];
+   snprintf(path, sizeof(path), "/load_%u", (unsigned)getpid());
+   msg::TAgentKey me = msg::createAgent(path);
+   std::vector<msg::TAgentKey> targets;
+   for(size_t i = 0; i < load.targets.size(); i++)
+      targets.push_back(msg::createAgent(load.targets[i].c_str()));
+   msg::TResourceKey sentKey = msg::createResource("loadSentUs", msg::COUNTER64);
+   msg::TResourceKey payloadKey = msg::createResource("loadPayload", msg::OCTET_STR);
+
+   unsigned int seed = id + 1;
+   Tn8 payload[MESSAGE_BODY_MEM_SIZE];
+   memset(payload, 'x', sizeof(payload));
+   double interval = load.rate > 0 ? 1e6 * load.concurrency / load.rate : 0;
+   std::vector<Ts64> latencies;
+   size_t failed = 0;
+   Ts64 start = nowUs();
+   Ts64 end = start + (Ts64)(load.duration * 1e6);
+   for(size_t n = 0; ; n++)
+      {
+      Ts64 due = start + (Ts64)(n * interval);
+      Ts64 now = nowUs();
+      if(due >= end || now >= end)
+         break;
+      if(due > now)
+         usleep(due - now);
+
+      size_t pick = rand_r(&seed) % load.totalWeight;
+      size_t v = 0;
+      while(pick >= load.mix[v].weight)
+         pick -= load.mix[v++].weight;
+      msg::TMsg out(load.mix[v].verb);
+      out.setSender(me);
+      out.setRecipient(targets[rand_r(&seed) % targets.size()]);
+      size_t fields = load.minFields + rand_r(&seed) % (load.maxFields - load.minFields + 1);
+      for(size_t f = 0; f < fields; f++)
+         {
+         size_t size = load.minSize + rand_r(&seed) % (load.maxSize - load.minSize + 1);
+         Tn8 *value = out.reserve(payloadKey, size);
+         if(value)
+            memcpy(value, payload, size);
+         }
+
+      Ts64 before = nowUs();
+      out.put<Ts64>(sentKey, before);
+      if(SUCCESS == msg::send(&out))
+         latencies.push_back(nowUs() - before);
+      else
+         failed++;
+      }
+
+   size_t count = latencies.size();
+   write(fd, &count, sizeof(count));
+   write(fd, &failed, sizeof(failed));
+   if(count)
+      write(fd, &latencies[0], count * sizeof(Ts64));
+   msg::destroyAgent(path);
+   }
+
+   static int
+runLoad(int argc, char *argv[])
+   {
+   TLoad load;
+   load.rate = 1000;
+   load.concurrency = 1;
+   load.duration = 10;
+   load.totalWeight = 0;
+   load.minFields = load.maxFields = 1;
+   load.minSize = load.maxSize = 16;
+   Tnc8 *mix = "set";
+
+   static struct option options[] =
+      {
+      {"rate", required_argument, NULL, 'r'},
+      {"concurrency", required_argument, NULL, 'c'},
+      {"duration", required_argument, NULL, 'd'},
+      {"targets", required_argument, NULL, 't'},
+      {"mix", required_argument, NULL, 'm'},
+      {"fields", required_argument, NULL, 'f'},
+      {"size", required_argument, NULL, 's'},
+      {NULL, 0, NULL, 0}
+      };
+   int opt;
+   while(-1 != (opt = getopt_long(argc, argv, "r:c:d:t:m:f:s:", options, NULL)))
+      {
+      switch(opt)
+         {
+         case 'r': load.rate = atof(optarg); break;
+         case 'c': load.concurrency = strtoul(optarg, NULL, 10); break;
+         case 'd': load.duration = atof(optarg); break;
+         case 't': split(optarg, &load.targets); break;
+         case 'm': mix = optarg; break;
+         case 'f': parseRange(optarg, &load.minFields, &load.maxFields); break;
+         case 's': parseRange(optarg, &load.minSize, &load.maxSize); break;
+         default:
+            return 1;
+         }
+      }
+
+   // e.g. "set:3,get:1"
+   std::vector<std::string> verbs;
+   split(mix, &verbs);
+   for(size_t i = 0; i < verbs.size(); i++)
+      {
+      size_t colon = verbs[i].find(':');
+      TVerbWeight vw;
+      vw.verb = parseVerb(verbs[i].substr(0, colon).c_str());
+      vw.weight = colon == std::string::npos ? 1 : strtoul(verbs[i].c_str() + colon + 1, NULL, 10);
+      load.mix.push_back(vw);
+      load.totalWeight += vw.weight;
+      }
+   if(load.targets.empty() || load.totalWeight == 0 || load.concurrency == 0 || load.maxSize > MESSAGE_BODY_MEM_SIZE)
+      {
+      printf("usage: messaging_test load --targets /a,/b [--rate 1000] [--concurrency 1] [--duration 10]\n"
+             "          [--mix set:3,get:1] [--fields 1-4] [--size 16-1024]\n");
+      return 1;
+      }
+
+   std::vector<int> pipes;
+   for(size_t id = 0; id < load.concurrency; id++)
+      {
+      int fds[2];
+      if(pipe(fds) != 0)
+         return 1;
+      if(fork() == 0)
+         {
+         close(fds[0]);
+         generate(load, id, fds[1]);
+         _exit(0);
+         }
+      close(fds[1]);
+      pipes.push_back(fds[0]);
+      }
+
+   std::vector<Ts64> latencies;
+   size_t sent = 0, failed = 0;
+   for(size_t i = 0; i < pipes.size(); i++)
+      {
+      FILE *fp = fdopen(pipes[i], "rb");
+      size_t count = 0, lost = 0;
+      if(fread(&count, sizeof(count), 1, fp) == 1 && fread(&lost, sizeof(lost), 1, fp) == 1)
+         {
+         size_t have = latencies.size();
+         latencies.resize(have + count);
+         if(count && fread(&latencies[have], sizeof(Ts64), count, fp) != count)
+            latencies.resize(have);
+         sent += count;
+         failed += lost;
+         }
+      fclose(fp);
+      }
+   while(wait(NULL) > 0);
+
+   report("sent", latencies, sent, load.duration);
+   if(failed)
+      printf("%u messages could not be sent\n", (unsigned)failed);
+   return 0;
+   }
+
+/*
+ * Receive as the agent at path for seconds, or until interrupted.
+ */
+   static int
+runSink(Tnc8 *path, double seconds)
+   {
+   msg::TAgentKey me = msg::createAgent(path);
+   msg::TResourceKey sentKey = msg::createResource("loadSentUs", msg::COUNTER64);
+   std::vector<Ts64> latencies;
+   size_t count = 0;
+   Ts64 first = 0, last = 0;
+   Ts64 end = seconds > 0 ? nowUs() + (Ts64)(seconds * 1e6) : 0;
+   while(end == 0 || nowUs() < end)
+      {
+      msg::TMsg *in = msg::receive(me);
+      if(!in)
+         continue;
+      last = nowUs();
+      if(!count++)
+         first = last;
+      for(msg::TFieldCursor field(*in); field.valid(); field.next())
+         {
+         if(field.key() == sentKey)
+            {
+            latencies.push_back(last - in->get<Ts64>(field.offset()));
+            break;
+            }
+         }
+      msg::clearReceived(me);
+      }
+   report("received", latencies, count, (last - first) / 1e6);
+   return 0;
    }
 
 int main(int argc, char *argv[])
@@ -33,6 +317,11 @@ int main(int argc, char *argv[])
    std::map<msg::TResourceKey, std::map<std::string, std::string> > resources;
    msg::initialize();
 
+   if(argc >= 2 && strcmp(argv[1], "load") == 0)
+      return runLoad(argc - 1, argv + 1);
+   if(argc >= 3 && strcmp(argv[1], "sink") == 0)
+      return runSink(argv[2], argc >= 4 ? atof(argv[3]) : 0);
+
 
 
    if(argc >= 5 && (argc - 3) % 2 == 0)
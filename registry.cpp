@@ -0,0 +1,272 @@
+/*!
+ * @namespace msg::registry
+ * Host-wide table of agent and resource names and their keys, in shared
+ * memory, so that every process agrees on every key and names can be added
+ * at run-time. names.conf only seeds it.
+ *
+ * The slot a key lives in is the key modulo the size of the table, so keys
+ * and slots are probed together and a free slot always means a free key. A
+ * name's key is its hash if that slot is free, or else its hash plus however
+ * many slots further on it found one free. Since slots collide far more often
+ * than hashes do, keys are not those a process computes on its own without
+ * the registry: every process on the host has to use it. A key that would
+ * reach the keys the library keeps for itself (see attach) is wrapped round
+ * to its slot number instead, which is still unique to the slot.
+ *
+ * The segment starts with a magic number and a layout version, and one made
+ * with another layout is refused rather than misread.
+ *
+ * Slots are claimed with compare-and-swap and published once filled in, so
+ * neither lookups nor registration take a lock; a reader only ever waits on a
+ * slot that is in the middle of being filled in. Such a slot records who is
+ * filling it in, and is emptied again if that process has died meanwhile.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "registry.hpp"
+#include "log.hpp"
+
+#define REGISTRY_CAPACITY 1024
+#define REGISTRY_NAME_MAX 64
+#define REGISTRY_MAGIC 0x44575247 // "DWRG"
+#define REGISTRY_LAYOUT 3
+
+namespace msg
+   {
+   namespace registry
+      {
+      const size_t NOT_FOUND = (size_t)-1;
+
+      typedef enum
+         {
+         SLOT_EMPTY,
+         SLOT_READY
+         } TSlotState;
+
+      typedef struct
+         {
+         volatile Ts32 state; // a TSlotState, or minus the pid filling it in
+         Ts32 type;
+         size_t key;
+         Tn8 name[REGISTRY_NAME_MAX];
+         } TSlot;
+
+      typedef struct
+         {
+         volatile Tu32 magic;
+         volatile Tu32 layout;
+         volatile size_t version; // bumped for every name registered
+         TSlot slots[TABLE_COUNT][REGISTRY_CAPACITY];
+         } TShared;
+
+      static TShared *g_shared = NULL;
+      static size_t g_keyLimit = 0;
+
+      /*!
+       * Map the registry named shmName, creating it if need be.
+       * @param keyLimit Keys from this one up are kept for the library's own
+       * use and never given to a name.
+       */
+         TBoolean
+      attach
+         (
+         Tnc8 *shmName,
+         size_t keyLimit
+         )
+         {
+         if(g_shared)
+            return TRUE;
+         if(keyLimit < REGISTRY_CAPACITY)
+            {
+            MESSAGING_LOG_ERROR("Key limit %u is below the registry's capacity", (unsigned)keyLimit);
+            return FALSE;
+            }
+
+         int fd = shm_open(shmName, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+         if(-1 == fd)
+            {
+            MESSAGING_LOG_POSIX_ERROR;
+            return FALSE;
+            }
+         // a new segment is all zeroes, i.e. all slots empty
+         struct stat st;
+         if(0 != fstat(fd, &st) || (st.st_size == 0 && 0 != ftruncate(fd, sizeof(TShared))))
+            {
+            MESSAGING_LOG_POSIX_ERROR;
+            close(fd);
+            return FALSE;
+            }
+         if(st.st_size != 0 && st.st_size != (off_t)sizeof(TShared))
+            {
+            MESSAGING_LOG_ERROR("\"%s\" is not a registry of this layout", shmName);
+            close(fd);
+            return FALSE;
+            }
+         TVoid *p = mmap(NULL, sizeof(TShared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+         close(fd);
+         if(MAP_FAILED == p)
+            {
+            MESSAGING_LOG_POSIX_ERROR;
+            return FALSE;
+            }
+         TShared *shared = (TShared *)p;
+         // whoever gets here first on a new segment stamps it; the layout
+         // goes in before the magic number that vouches for it
+         if(shared->magic == 0)
+            {
+            __sync_bool_compare_and_swap(&shared->layout, 0, REGISTRY_LAYOUT);
+            __sync_bool_compare_and_swap(&shared->magic, 0, REGISTRY_MAGIC);
+            }
+         if(shared->magic != REGISTRY_MAGIC || shared->layout != REGISTRY_LAYOUT)
+            {
+            MESSAGING_LOG_ERROR("\"%s\" is not a registry of layout %d", shmName, REGISTRY_LAYOUT);
+            munmap(p, sizeof(TShared));
+            return FALSE;
+            }
+         g_shared = shared;
+         g_keyLimit = keyLimit;
+         return TRUE;
+         }
+
+         TBoolean
+      isAttached()
+         {
+         return g_shared != NULL;
+         }
+
+      /*!
+       * The number of names ever registered; it only grows.
+       */
+         size_t
+      getVersion()
+         {
+         return g_shared ? g_shared->version : 0;
+         }
+
+      /*!
+       * Wait for slot to be filled in if it is being, or empty it if whoever
+       * was filling it in died first.
+       * @return SLOT_READY, or SLOT_EMPTY if it was emptied.
+       */
+         static Ts32
+      waitReady
+         (
+         TSlot *slot
+         )
+         {
+         Ts32 state;
+         while((state = slot->state) < 0)
+            {
+            if(-1 == kill(-state, 0) && ESRCH == errno)
+               __sync_bool_compare_and_swap(&slot->state, state, SLOT_EMPTY);
+            else
+               sched_yield();
+            }
+         __sync_synchronize();
+         return state;
+         }
+
+      /*!
+       * @param hashed The hash of name, where probing starts.
+       * @return The key of name, or NOT_FOUND.
+       */
+         size_t
+      lookup
+         (
+         TTable table,
+         Tnc8 *name,
+         size_t hashed
+         )
+         {
+         if(!g_shared)
+            return NOT_FOUND;
+         for(size_t probe = 0; probe < REGISTRY_CAPACITY; probe++)
+            {
+            TSlot *slot = &g_shared->slots[table][(hashed + probe) % REGISTRY_CAPACITY];
+            if(slot->state == SLOT_EMPTY || waitReady(slot) == SLOT_EMPTY)
+               return NOT_FOUND;
+            if(strncmp(slot->name, name, REGISTRY_NAME_MAX) == 0)
+               return slot->key;
+            }
+         return NOT_FOUND;
+         }
+
+      /*!
+       * Register name, unless it already is.
+       * @return The key of name, or NOT_FOUND if it cannot be registered.
+       */
+         size_t
+      enroll
+         (
+         TTable table,
+         Tnc8 *name,
+         Ts32 type,
+         size_t hashed
+         )
+         {
+         if(!g_shared || strlen(name) >= REGISTRY_NAME_MAX)
+            {
+            MESSAGING_LOG_ERROR("Cannot register \"%s\"", name);
+            return NOT_FOUND;
+            }
+         for(size_t probe = 0; probe < REGISTRY_CAPACITY; probe++)
+            {
+            TSlot *slot = &g_shared->slots[table][(hashed + probe) % REGISTRY_CAPACITY];
+            if(__sync_bool_compare_and_swap(&slot->state, SLOT_EMPTY, -(Ts32)getpid()))
+               {
+               strncpy(slot->name, name, REGISTRY_NAME_MAX);
+               slot->type = type;
+               slot->key = hashed + probe;
+               if(slot->key >= g_keyLimit)
+                  slot->key = (hashed + probe) % REGISTRY_CAPACITY;
+               __sync_synchronize();
+               slot->state = SLOT_READY;
+               __sync_fetch_and_add(&g_shared->version, 1);
+               return slot->key;
+               }
+            if(waitReady(slot) == SLOT_EMPTY)
+               {
+               probe--; // emptied, so claim it after all
+               continue;
+               }
+            if(strncmp(slot->name, name, REGISTRY_NAME_MAX) == 0)
+               return slot->key;
+            }
+         MESSAGING_LOG_ERROR("Registry is full, cannot register \"%s\"", name);
+         return NOT_FOUND;
+         }
+
+      /*!
+       * Find the name and type registered under key.
+       */
+         TBoolean
+      find
+         (
+         TTable table,
+         size_t key,
+         std::string *name,
+         Ts32 *type
+         )
+         {
+         if(!g_shared)
+            return FALSE;
+         TSlot *slot = &g_shared->slots[table][key % REGISTRY_CAPACITY];
+         if(slot->state == SLOT_EMPTY || waitReady(slot) == SLOT_EMPTY)
+            return FALSE;
+         if(slot->key != key)
+            return FALSE;
+         if(name)
+            name->assign(slot->name, strnlen(slot->name, REGISTRY_NAME_MAX));
+         if(type)
+            *type = slot->type;
+         return TRUE;
+         }
+      }
+   }
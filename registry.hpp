@@ -0,0 +1,41 @@
+/*
+ * registry.hpp
+ *
+ *  Created on: Oct 18, 2026
+ */
+
+#ifndef REGISTRY_HPP_
+#define REGISTRY_HPP_
+
+#include <string>
+
+#include "include/aditypes.h"
+
+namespace msg
+   {
+   namespace registry
+      {
+      typedef enum
+         {
+         AGENTS,
+         RESOURCES,
+         TABLE_COUNT
+         } TTable;
+
+      extern const size_t NOT_FOUND;
+
+      TBoolean attach(Tnc8 *shmName, size_t keyLimit);
+
+      TBoolean isAttached();
+
+      size_t getVersion();
+
+      size_t lookup(TTable, Tnc8 *name, size_t hashed);
+
+      size_t enroll(TTable, Tnc8 *name, Ts32 type, size_t hashed);
+
+      TBoolean find(TTable, size_t key, std::string *name, Ts32 *type);
+      }
+   }
+
+#endif /* REGISTRY_HPP_ */
@@ -1,11 +1,64 @@
 #include <stdlib.h>
 
+#include <map>
+#include <string>
+
 #include "represent.hpp"
 
 #include "snmp_debug.hpp"
 
 #include "log.hpp"
 
+#define IPV4_OCTETS 4
+#define IPV4_TEXT_MAX 16 // "255.255.255.255" and a null
+
+/*!
+ * Decimal text of every octet value, so formatting an address is four table
+ * lookups and copies instead of four calls to snprintf. The last byte of
+ * each entry holds the number of digits.
+ */
+static char g_octetText[256][4];
+
+   static TVoid
+InitOctetText()
+   {
+   static TBoolean ready = FALSE;
+   if(ready)
+      return;
+   for(size_t o = 0; o < 256; o++)
+      {
+      size_t l = 0;
+      if(o >= 100)
+         g_octetText[o][l++] = '0' + o / 100;
+      if(o >= 10)
+         g_octetText[o][l++] = '0' + o / 10 % 10;
+      g_octetText[o][l++] = '0' + o % 10;
+      g_octetText[o][3] = l;
+      }
+   ready = TRUE;
+   }
+
+   static size_t
+FormatIpv4
+   (
+   char *text, // at least IPV4_TEXT_MAX bytes
+   const unsigned char *octets,
+   size_t count
+   )
+   {
+   size_t l = 0;
+   for(size_t i = 0; i < count; i++)
+      {
+      const char *o = g_octetText[octets[i]];
+      text[l] = '.';
+      l += i > 0;
+      memcpy(text + l, o, 3);
+      l += o[3];
+      }
+   text[l] = '\0';
+   return l;
+   }
+
    size_t
 RepresentAsInternalIpv4A
    (
@@ -15,26 +68,23 @@ RepresentAsInternalIpv4A
    size_t lin
    )
    {
-   size_t iin = 0;
-   size_t iout = 0;
-   TBoolean includeNull = TRUE;
-   iout += snprintf(pout, lout - iout, "%d", pin[iin]);
-   SNMP_LOG_INFO("First byte = %d", pin[0]);
-   for(iin = 1; iin < lin && iin < 4 && iout < lout; iin++)
+   char text[IPV4_TEXT_MAX];
+   InitOctetText();
+   size_t l = FormatIpv4(text, (const unsigned char *)pin, lin < IPV4_OCTETS ? lin : IPV4_OCTETS);
+   SNMP_LOG_INFO("Address = %s", text);
+   if(l + 1 <= lout)
       {
-      size_t l = snprintf(pout + iout, lout - iout, ".%d", pin[iin]);
-      if(l + iout < lout)
-         iout += l;
-      else
-         {
-         includeNull = FALSE;
-         break;
-         }
+      memcpy(pout, text, l + 1);
+      return l + 1; // to include null
       }
-   SNMP_LOG_INFO("Address = %s", pout);
-   return iout + (includeNull? 1 : 0); // to include null
+   memcpy(pout, text, lout);
+   return lout;
    }
 
+/*!
+ * Parse dotted-quad text into octets.
+ * @return The number of octets, or 0 if pin is not a valid address.
+ */
    size_t
 RepresentAsSnmpIpv4A
    (
@@ -44,98 +94,335 @@ RepresentAsSnmpIpv4A
    size_t lin
    )
    {
+   unsigned char octets[IPV4_OCTETS];
+   size_t iOctet = 0;
+   size_t digits = 0;
+   unsigned int value = 0;
    size_t iin;
-   size_t iout = 0;
-   for(iin = 0; iin < lin && iout < lout; iin++)
+
+   for(iin = 0; iin < lin && pin[iin] != '\0'; iin++)
       {
-      if(pin[iin] == '.')
+      unsigned int d = (unsigned char)pin[iin] - '0';
+      if(d <= 9)
          {
-         iout++;
+         value = value * 10 + d;
+         if(++digits > 3 || value > 255)
+            break;
          }
-      else if(iin == 0 || pin[iin - 1] == '.')
+      else if(pin[iin] == '.' && digits > 0 && iOctet < IPV4_OCTETS - 1)
          {
-         pout[iout] = (char)strtol(pin + iin, NULL, 10);
+         octets[iOctet++] = value;
+         value = 0;
+         digits = 0;
          }
+      else
+         break;
       }
-   return iout + 1;
+
+   if((iin < lin && pin[iin] != '\0') || digits == 0 || iOctet != IPV4_OCTETS - 1 || lout < IPV4_OCTETS)
+      {
+      MESSAGING_LOG_ERROR("\"%.*s\" is not an IPv4 address", (int)lin, pin);
+      return 0;
+      }
+   octets[iOctet++] = value;
+   memcpy(pout, octets, IPV4_OCTETS);
+   return IPV4_OCTETS;
    }
 
-   long
-RepresentInteger
+/*!
+ * RepresentAsInternalIpv4A over a column of addresses, e.g. every
+ * ipPortAddress of a table.
+ * @param pin count addresses of IPV4_OCTETS bytes each, back to back.
+ * @param pout count strings of IPV4_TEXT_MAX bytes each, back to back.
+ */
+   TVoid
+RepresentAsInternalIpv4Column
+   (
+   char *pout,
+   const char *pin,
+   size_t count
+   )
+   {
+   InitOctetText();
+   for(size_t i = 0; i < count; i++)
+      FormatIpv4(pout + i * IPV4_TEXT_MAX, (const unsigned char *)pin + i * IPV4_OCTETS, IPV4_OCTETS);
+   }
+
+/*!
+ * RepresentAsSnmpIpv4A over a column of addresses.
+ * @param pin count strings of stride bytes each.
+ * @param pout count addresses of IPV4_OCTETS bytes each, back to back. Invalid
+ * addresses come out as 0.0.0.0.
+ * @return The number of valid addresses.
+ */
+   size_t
+RepresentAsSnmpIpv4Column
+   (
+   char *pout,
+   const char *pin,
+   size_t stride,
+   size_t count
+   )
+   {
+   size_t valid = 0;
+   for(size_t i = 0; i < count; i++)
+      {
+      if(RepresentAsSnmpIpv4A(pout + i * IPV4_OCTETS, IPV4_OCTETS, pin + i * stride, stride))
+         valid++;
+      else
+         memset(pout + i * IPV4_OCTETS, 0, IPV4_OCTETS);
+      }
+   return valid;
+   }
+
+   static long
+RepresentSnmpInteger
    (
    long i,
-   msg::TResourceType t,
-   msg::TAgentKey a
+   msg::TResourceType t
    )
    {
-   if(msg::getAgentKey("/snmp") == a)
+   switch(t)
       {
-      switch(t)
-         {
-         case msg::BOOLEAN:
-            //MESSAGING_LOG_INFO("Its a boolean!");
-            if(i)
-               return 1;
-            else
-               return 2;
-         case msg::OBJECT_ID:
-            //MESSAGING_LOG_INFO("Its an object ID! i = %ld", i);
-            return i + 1;
-         default:;
-         }
+      case msg::BOOLEAN:
+         //MESSAGING_LOG_INFO("Its a boolean!");
+         if(i)
+            return 1;
+         else
+            return 2;
+      case msg::OBJECT_ID:
+         //MESSAGING_LOG_INFO("Its an object ID! i = %ld", i);
+         return i + 1;
+      default:;
       }
-   else if(msg::getAgentKey("/mux_manager") == a)
+   return i;
+   }
+
+   static long
+RepresentInternalInteger
+   (
+   long i,
+   msg::TResourceType t
+   )
+   {
+   switch(t)
       {
-      switch(t)
-         {
-         case msg::BOOLEAN:
-            if(i == 1)
-               return TRUE;
-            else
-               return FALSE;
-         case msg::OBJECT_ID:
-            return i - 1;
-         default:;
-         }
+      case msg::BOOLEAN:
+         if(i == 1)
+            return TRUE;
+         else
+            return FALSE;
+      case msg::OBJECT_ID:
+         return i - 1;
+      default:;
       }
    return i;
    }
 
-   size_t
-RepresentValue
+   static size_t
+RepresentSnmpIpv4A
    (
    char *pout,
    size_t lout,
    const char *pin,
-   size_t lin,
-   msg::TResourceType t,
-   msg::TAgentKey a
+   size_t lin
+   )
+   {
+   size_t len = RepresentAsSnmpIpv4A(pout, lout, pin, lin);
+   return len ? len + 1 : 0; // to include null
+   }
+
+   static long
+RepresentIntegerAsIs
+   (
+   long i,
+   msg::TResourceType t
+   )
+   {
+   return i;
+   }
+
+   static size_t
+RepresentValueAsIs
+   (
+   char *pout,
+   size_t lout,
+   const char *pin,
+   size_t lin
    )
    {
-   size_t len;
-   if(msg::getAgentKey("/snmp") == a)
+   size_t len = lin > lout ? lout : lin;
+   strncpy(pout, pin, len);
+   return len;
+   }
+
+/*!
+ * The tables below are indexed by type, which only works while the types are
+ * numbered 0, 1, 2... in order; this fails to compile if rest.h ever gives
+ * them other values, e.g. ASN.1 tags.
+ */
+typedef char TTypesAreContiguous[
+   msg::OCTET_STR == 0 &&
+   msg::BOOLEAN == msg::OCTET_STR + 1 &&
+   msg::INTEGER == msg::BOOLEAN + 1 &&
+   msg::UNSIGNED == msg::INTEGER + 1 &&
+   msg::OBJECT_ID == msg::UNSIGNED + 1 &&
+   msg::COUNTER64 == msg::OBJECT_ID + 1 &&
+   msg::COUNTER == msg::COUNTER64 + 1 &&
+   msg::UINTEGER == msg::COUNTER + 1 &&
+   msg::IPADDRESS == msg::UINTEGER + 1 &&
+   msg::TIMETICKS == msg::IPADDRESS + 1 &&
+   msg::GAUGE == msg::TIMETICKS + 1 &&
+   msg::OPAQUE == msg::GAUGE + 1 &&
+   msg::RESOURCE_KEY == msg::OPAQUE + 1 &&
+   msg::UNKNOWN_TYPE == msg::RESOURCE_KEY + 1 ? 1 : -1];
+
+/*!
+ * What a particular recipient expects each type of resource to look like.
+ */
+typedef struct
+   {
+   TRepresentInteger integer[msg::UNKNOWN_TYPE + 1];
+   TRepresentValue value[msg::UNKNOWN_TYPE + 1];
+   } TRepresentation;
+
+   static TVoid
+InitRepresentation
+   (
+   TRepresentation *r
+   )
+   {
+   for(size_t t = 0; t <= msg::UNKNOWN_TYPE; t++)
       {
-      if(t == msg::IPADDRESS)
-         {
-         len = RepresentAsSnmpIpv4A(pout, lout, pin, lin);
-         return len + 1; // to include null
-         }
+      r->integer[t] = RepresentIntegerAsIs;
+      r->value[t] = RepresentValueAsIs;
       }
-   else if(msg::getAgentKey("/mux_manager") == a)
+   }
+
+/*!
+ * Representations registered by agent path. Recipients are resolved to their
+ * representation lazily since they may be created after registration.
+ */
+   static std::map<std::string, TRepresentation>&
+Registry()
+   {
+   static std::map<std::string, TRepresentation> registry;
+   static TBoolean builtIn = FALSE;
+   if(!builtIn)
       {
-      if(t == msg::IPADDRESS)
+      builtIn = TRUE;
+      TRepresentation &snmp = registry["/snmp"];
+      InitRepresentation(&snmp);
+      snmp.integer[msg::BOOLEAN] = RepresentSnmpInteger;
+      snmp.integer[msg::OBJECT_ID] = RepresentSnmpInteger;
+      snmp.value[msg::IPADDRESS] = RepresentSnmpIpv4A;
+
+      TRepresentation &internal = registry["/mux_manager"];
+      InitRepresentation(&internal);
+      internal.integer[msg::BOOLEAN] = RepresentInternalInteger;
+      internal.integer[msg::OBJECT_ID] = RepresentInternalInteger;
+      internal.value[msg::IPADDRESS] = RepresentAsInternalIpv4A;
+      }
+   return registry;
+   }
+
+static std::map<msg::TAgentKey, const TRepresentation *> g_dispatch;
+static msg::TAgentKey g_lastAgent = msg::NOT_AN_AGENT;
+static const TRepresentation *g_lastRepresentation = NULL;
+
+   static const TRepresentation *
+Lookup
+   (
+   msg::TAgentKey a
+   )
+   {
+   if(g_lastRepresentation && a == g_lastAgent)
+      return g_lastRepresentation;
+
+   std::map<msg::TAgentKey, const TRepresentation *>::iterator it = g_dispatch.find(a);
+   if(it == g_dispatch.end())
+      {
+      static TRepresentation asIs;
+      static TBoolean asIsReady = FALSE;
+      if(!asIsReady)
          {
-         len = RepresentAsInternalIpv4A(pout, lout, pin, lin);
-         return len;
+         InitRepresentation(&asIs);
+         asIsReady = TRUE;
          }
+
+      Tnc8 *path = msg::getPath(a);
+      if(path[0] == '\0')
+         return &asIs; // not named yet, don't remember it
+
+      std::map<std::string, TRepresentation> &registry = Registry();
+      std::map<std::string, TRepresentation>::iterator reg = registry.find(path);
+      const TRepresentation *r = reg == registry.end() ? &asIs : &reg->second;
+      it = g_dispatch.insert(std::make_pair(a, r)).first;
       }
 
-   len = lin > lout ? lout : lin;
-   strncpy(pout, pin, len);
-   return len;
+   g_lastAgent = a;
+   g_lastRepresentation = it->second;
+   return g_lastRepresentation;
    }
 
+/*!
+ * Override how resources of type t are represented for the agent at
+ * agentPath. Either representer may be NULL to leave it unchanged.
+ */
+   TVoid
+RepresentRegister
+   (
+   const char *agentPath,
+   msg::TResourceType t,
+   TRepresentInteger integer,
+   TRepresentValue value
+   )
+   {
+   if(t > msg::UNKNOWN_TYPE)
+      {
+      MESSAGING_LOG_ERROR("Cannot register a representation for type %u", t);
+      return;
+      }
 
+   std::map<std::string, TRepresentation> &registry = Registry();
+   if(registry.count(agentPath) == 0)
+      InitRepresentation(&registry[agentPath]);
+   TRepresentation &r = registry[agentPath];
+   if(integer)
+      r.integer[t] = integer;
+   if(value)
+      r.value[t] = value;
 
+   // recipients resolved so far may now point at the wrong representation
+   g_dispatch.clear();
+   g_lastRepresentation = NULL;
+   }
 
+   long
+RepresentInteger
+   (
+   long i,
+   msg::TResourceType t,
+   msg::TAgentKey a
+   )
+   {
+   if(t > msg::UNKNOWN_TYPE)
+      return i;
+   return Lookup(a)->integer[t](i, t);
+   }
 
+   size_t
+RepresentValue
+   (
+   char *pout,
+   size_t lout,
+   const char *pin,
+   size_t lin,
+   msg::TResourceType t,
+   msg::TAgentKey a
+   )
+   {
+   if(t > msg::UNKNOWN_TYPE)
+      return RepresentValueAsIs(pout, lout, pin, lin);
+   return Lookup(a)->value[t](pout, lout, pin, lin);
+   }
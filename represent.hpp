@@ -10,7 +10,14 @@
 
 #include "solib/messaging/messaging.hpp"
 
+typedef long   (*TRepresentInteger) (long i, msg::TResourceType t);
+typedef size_t (*TRepresentValue)   (char *pout, size_t lout, const char *pin, size_t lin);
+
+void  RepresentRegister      (const char *agentPath, msg::TResourceType t, TRepresentInteger, TRepresentValue);
 long  RepresentInteger       (long i, msg::TResourceType t, msg::TAgentKey);
 size_t RepresentValue    (char *pout, size_t lout, const char *pin, size_t lin, msg::TResourceType t, msg::TAgentKey);
 size_t RepresentAsInternalIpv4A (char *pout, size_t lout, const char *pin, size_t lin);
+size_t RepresentAsSnmpIpv4A (char *pout, size_t lout, const char *pin, size_t lin);
+void   RepresentAsInternalIpv4Column (char *pout, const char *pin, size_t count);
+size_t RepresentAsSnmpIpv4Column (char *pout, const char *pin, size_t stride, size_t count);
 #endif /* REPRESENT_HPP_ */
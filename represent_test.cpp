@@ -0,0 +1,100 @@
+/*
+ * represent_test.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *
+ * Checks that RepresentAsSnmpIpv4A takes dotted-quad text and nothing else,
+ * and that RepresentAsInternalIpv4A gives back the text it took.
+ */
+
+#include <cstdio>
+#include <cstring>
+
+#include "represent.hpp"
+#include "check.hpp"
+
+/*!
+ * Parse the first lin bytes of text, which must come out as a, b, c, d.
+ */
+   static TVoid
+accepts
+   (
+   Tnc8 *text,
+   size_t lin,
+   T8 a,
+   T8 b,
+   T8 c,
+   T8 d
+   )
+   {
+   T8 octets[4] = {0, 0, 0, 0};
+   size_t l = RepresentAsSnmpIpv4A((Tn8 *)octets, sizeof(octets), text, lin);
+   CHECK(l == 4, "\"%.*s\": rejected", (int)lin, text);
+   CHECK(octets[0] == a && octets[1] == b && octets[2] == c && octets[3] == d,
+         "\"%.*s\": came out as %u.%u.%u.%u", (int)lin, text, octets[0], octets[1], octets[2], octets[3]);
+   }
+
+   static TVoid
+rejects
+   (
+   Tnc8 *text,
+   size_t lin
+   )
+   {
+   Tn8 octets[4];
+   CHECK(0 == RepresentAsSnmpIpv4A(octets, sizeof(octets), text, lin), "\"%.*s\": accepted", (int)lin, text);
+   }
+
+   int
+main()
+   {
+   accepts("0.0.0.0", 8, 0, 0, 0, 0);
+   accepts("255.255.255.255", 16, 255, 255, 255, 255);
+   accepts("10.1.20.254", 12, 10, 1, 20, 254);
+   accepts("010.001.2.3", 12, 10, 1, 2, 3);
+   accepts("1.2.3.4junk", 7, 1, 2, 3, 4);       // only lin bytes are text
+
+   // out-of-range octets
+   rejects("256.0.0.1", 10);
+   rejects("1.2.3.256", 10);
+   rejects("1.2.999.4", 10);
+   rejects("0001.2.3.4", 11);
+   // missing or extra dots
+   rejects("1.2.3", 6);
+   rejects("1.2.34", 7);
+   rejects("1..2.3", 7);
+   rejects(".1.2.3", 7);
+   rejects("1.2.3.", 7);
+   rejects("1.2.3.4.5", 10);
+   // trailing garbage
+   rejects("1.2.3.4x", 9);
+   rejects("1.2.3.4 ", 9);
+   rejects("1.2.3.4/24", 11);
+   rejects("1.2.-3.4", 9);
+   // empty
+   rejects("", 1);
+   rejects("1.2.3.4", 0);
+
+   Tn8 shortOut[3];
+   CHECK(0 == RepresentAsSnmpIpv4A(shortOut, sizeof(shortOut), "1.2.3.4", 8), "an address into 3 bytes: accepted");
+
+   Tn8 column[3 * 16] = "1.2.3.4";
+   strcpy(column + 16, "1.2.3");
+   strcpy(column + 32, "5.6.7.8");
+   Tn8 addresses[3 * 4];
+   memset(addresses, 0xff, sizeof(addresses));
+   CHECK(2 == RepresentAsSnmpIpv4Column(addresses, column, 16, 3), "a column with one bad address: not 2 valid");
+   CHECK(0 == memcmp(addresses, "\1\2\3\4\0\0\0\0\5\6\7\10", sizeof(addresses)), "a column with one bad address: not zeroed in its place");
+
+   Tnc8 *texts[] = {"0.0.0.0", "9.99.100.255", "192.168.1.1"};
+   for(size_t i = 0; i < sizeof(texts) / sizeof(texts[0]); i++)
+      {
+      Tn8 octets[4];
+      Tn8 back[16];
+      RepresentAsSnmpIpv4A(octets, sizeof(octets), texts[i], strlen(texts[i]) + 1);
+      size_t l = RepresentAsInternalIpv4A(back, sizeof(back), octets, sizeof(octets));
+      CHECK(l == strlen(texts[i]) + 1 && 0 == strcmp(back, texts[i]), "\"%s\": came back as \"%s\"", texts[i], back);
+      }
+
+   return checkResult("representation");
+   }
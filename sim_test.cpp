@@ -0,0 +1,149 @@
+/*
+ * sim_test.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *
+ * The dialogue of test_cases.cpp, with every agent in this one process on
+ * the simulated transport (see msg::simulate), so that it runs the same way
+ * every time and can be checked line by line. Also checks that destroyAgent
+ * leaves nothing of an agent in flight. Names stay private to the process
+ * rather than going in the host's shared registry.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "messaging.hpp"
+#include "check.hpp"
+
+typedef struct
+   {
+   Tnc8 *speaker;
+   Tnc8 *listener;
+   Tnc8 *line;
+   } TLine;
+
+static const TLine g_dialogue[] =
+   {
+   {"/gaurdian", "/sir_robin", "What is your name?"},
+   {"/sir_robin", "/gaurdian", "My name is Sir Robin."},
+   {"/gaurdian", "/sir_robin", "What is your quest?"},
+   {"/sir_robin", "/gaurdian", "I seek the Grail!"},
+   {"/gaurdian", "/sir_robin", "What is your favorite color?"},
+   {"/sir_robin", "/gaurdian", "Blue...I mean green! Aaaaah!!!"},
+   {"/gaurdian", "/king_arthur", "What is your name?"},
+   {"/king_arthur", "/gaurdian", "Arthur, King of England"},
+   {"/king_arthur", "/gaurdian", "and Leader of the Round Table!"},
+   {"/gaurdian", "/king_arthur", "What is your quest?"},
+   {"/king_arthur", "/gaurdian", "I seek the Holy Grail."},
+   {"/gaurdian", "/king_arthur", "What is the average wind speed velocity of an unladen swallow???"},
+   {"/king_arthur", "/gaurdian", "An African swallow or European swallow?"},
+   {"/gaurdian", "/king_arthur", "Uhh?! I don't know! Aaaaaah!!!"},
+   };
+
+static msg::TResourceKey g_speech;
+
+   static Ts32
+say
+   (
+   Tnc8 *speaker,
+   Tnc8 *listener,
+   Tnc8 *line
+   )
+   {
+   msg::TMsg message(REST_SET);
+   message.setSender(msg::getAgentKey(speaker));
+   message.setRecipient(msg::getAgentKey(listener));
+   message.append(g_speech, strlen(line), line);
+   return msg::send(&message);
+   }
+
+/*
+ * Each line is said, then heard with a blocking receive, which lets virtual
+ * time pass until it arrives.
+ * @return The virtual time the dialogue took.
+ */
+   static Ts64
+runDialogue
+   (
+   Tu32 seed
+   )
+   {
+   msg::TSimulation sim;
+   memset(&sim, 0, sizeof(sim));
+   sim.seed = seed;
+   sim.minDelayUs = 100;
+   sim.maxDelayUs = 5000;
+   msg::simulate(&sim);
+
+   msg::createAgent("/sir_robin", 1, 8192);
+   msg::createAgent("/gaurdian", 1, 8192);
+   msg::createAgent("/king_arthur", 1, 8192);
+
+   for(size_t i = 0; i < sizeof(g_dialogue) / sizeof(g_dialogue[0]); i++)
+      {
+      const TLine &line = g_dialogue[i];
+      CHECK(SUCCESS == say(line.speaker, line.listener, line.line), "%s could not say \"%s\"", line.speaker, line.line);
+      msg::TMsg *heard = msg::blockingReceive(msg::getAgentKey(line.listener));
+      CHECK(heard != NULL, "%s heard nothing", line.listener);
+      if(!heard)
+         continue;
+      std::string text(heard->getFieldPointer(0), heard->getFieldSize(0));
+      CHECK(text == line.line, "%s heard \"%s\" instead of \"%s\"", line.listener, text.c_str(), line.line);
+      CHECK(heard->getSender() == msg::getAgentKey(line.speaker), "\"%s\" came from the wrong agent", line.line);
+      }
+   Ts64 took = msg::getVirtualTime();
+
+   msg::destroyAgent("/sir_robin");
+   msg::destroyAgent("/gaurdian");
+   msg::destroyAgent("/king_arthur");
+   msg::simulate(NULL);
+   return took;
+   }
+
+/*
+ * What is in flight to an agent when it is destroyed must not turn up for
+ * the next agent of the same name.
+ */
+   static TVoid
+destroyInFlight()
+   {
+   msg::TSimulation sim;
+   memset(&sim, 0, sizeof(sim));
+   sim.seed = 1;
+   sim.minDelayUs = 1000;
+   sim.maxDelayUs = 1000;
+   msg::simulate(&sim);
+
+   msg::createAgent("/sir_robin", 1, 8192);
+   msg::createAgent("/gaurdian", 1, 8192);
+   CHECK(SUCCESS == say("/sir_robin", "/gaurdian", "Help!!!"), "could not call for help");
+   msg::destroyAgent("/gaurdian");
+
+   msg::TAgentKey gaurdian = msg::createAgent("/gaurdian", 1, 8192);
+   CHECK(0 == msg::runSimulation(), "a message in flight to a destroyed agent was delivered");
+   CHECK(0 == msg::getReceivedCount(gaurdian), "a new agent received what was sent to the old one");
+   CHECK(SUCCESS == say("/sir_robin", "/gaurdian", "Help!!!"), "could not call for help again, its queue is not empty");
+
+   msg::destroyAgent("/sir_robin");
+   msg::destroyAgent("/gaurdian");
+   msg::simulate(NULL);
+   }
+
+   int
+main()
+   {
+   // keys only this process uses, whatever else is registered on the host
+   setenv("DUMBWAITER_NAME_REGISTRY", "", 1);
+   msg::initialize("names.conf");
+   g_speech = msg::createResource("speech", msg::OCTET_STR);
+
+   Ts64 first = runDialogue(1);
+   CHECK(first == runDialogue(1), "the same seed gave a different run");
+   runDialogue(2);
+   destroyInFlight();
+
+   return checkResult("simulation");
+   }
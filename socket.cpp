@@ -0,0 +1,295 @@
+/*!
+ * @namespace msg::sock
+ * Stream sockets, Unix-domain or TCP, as a transport for messages between
+ * hosts (see msg::addSocketRoute and msg::listenSocket). Addresses are
+ * written "unix:/path/to/socket" or "tcp:host:port".
+ *
+ * Each message travels as a frame: its length as a 32-bit integer in network
+ * byte order, then the paths of its sender and recipient, each ending in a
+ * null, then the message as it would have gone into a queue. Frames
+ * can be batched on the way out so that many go in one write, and are read
+ * as many at a time as have arrived.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "socket.hpp"
+#include "log.hpp"
+
+#define SOCKET_BATCH_BYTES (64*1024)
+#define SOCKET_READ_BYTES (64*1024)
+#define SOCKET_FRAME_MAX (1024*1024)
+#define SOCKET_IOV_MAX 64
+
+namespace msg
+   {
+   namespace sock
+      {
+      /*!
+       * Connect to, or listen at, address.
+       * @return The descriptor, or -1 on failure.
+       */
+         int
+      open
+         (
+         Tnc8 *address,
+         TBoolean listening
+         )
+         {
+         int fd = -1;
+         if(strncmp(address, "unix:", 5) == 0)
+            {
+            struct sockaddr_un sun;
+            memset(&sun, 0, sizeof(sun));
+            sun.sun_family = AF_UNIX;
+            strncpy(sun.sun_path, address + 5, sizeof(sun.sun_path) - 1);
+
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if(-1 == fd)
+               {
+               MESSAGING_LOG_POSIX_ERROR;
+               return -1;
+               }
+            if(listening)
+               unlink(sun.sun_path);
+            if(-1 == (listening ? bind(fd, (struct sockaddr *)&sun, sizeof(sun)) : connect(fd, (struct sockaddr *)&sun, sizeof(sun))))
+               {
+               MESSAGING_LOG_ERROR("Cannot %s \"%s\"", listening ? "listen at" : "connect to", address);
+               MESSAGING_LOG_POSIX_ERROR;
+               ::close(fd);
+               return -1;
+               }
+            }
+         else if(strncmp(address, "tcp:", 4) == 0)
+            {
+            std::string host(address + 4);
+            size_t colon = host.rfind(':');
+            if(colon == std::string::npos)
+               {
+               MESSAGING_LOG_ERROR("No port in \"%s\"", address);
+               return -1;
+               }
+            std::string port = host.substr(colon + 1);
+            host.erase(colon);
+
+            struct addrinfo hints;
+            struct addrinfo *info = NULL;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = listening ? AI_PASSIVE : 0;
+            if(0 != getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &info))
+               {
+               MESSAGING_LOG_ERROR("Cannot resolve \"%s\"", address);
+               return -1;
+               }
+
+            struct addrinfo *ai;
+            for(ai = info; ai && fd == -1; ai = ai->ai_next)
+               {
+               fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+               if(-1 == fd)
+                  continue;
+               int on = 1;
+               if(listening)
+                  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+               else
+                  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+               if(-1 == (listening ? bind(fd, ai->ai_addr, ai->ai_addrlen) : connect(fd, ai->ai_addr, ai->ai_addrlen)))
+                  {
+                  ::close(fd);
+                  fd = -1;
+                  }
+               }
+            freeaddrinfo(info);
+            if(-1 == fd)
+               {
+               MESSAGING_LOG_ERROR("Cannot %s \"%s\"", listening ? "listen at" : "connect to", address);
+               return -1;
+               }
+            }
+         else
+            {
+            MESSAGING_LOG_ERROR("Unrecognized: %s", address);
+            return -1;
+            }
+
+         if(listening && -1 == ::listen(fd, SOMAXCONN))
+            {
+            MESSAGING_LOG_POSIX_ERROR;
+            ::close(fd);
+            return -1;
+            }
+         return fd;
+         }
+
+      /*!
+       * Send everything written so far.
+       */
+         Ts32
+      flush
+         (
+         TConnection *c
+         )
+         {
+         size_t sent = 0;
+         while(sent < c->out.size())
+            {
+            ssize_t n = ::send(c->fd, c->out.data() + sent, c->out.size() - sent, MSG_NOSIGNAL);
+            if(-1 == n)
+               {
+               if(errno == EINTR)
+                  continue;
+               MESSAGING_LOG_POSIX_ERROR;
+               c->out.erase(0, sent);
+               return FAILURE;
+               }
+            sent += n;
+            }
+         c->out.clear();
+         return SUCCESS;
+         }
+
+      /*!
+       * Frame and send length bytes.
+       * @param batch Hold the frame back to go with the next ones, until
+       * SOCKET_BATCH_BYTES are waiting or flush is called.
+       */
+         Ts32
+      write
+         (
+         TConnection *c,
+         const TVoid *frame,
+         size_t length,
+         TBoolean batch
+         )
+         {
+         uint32_t prefix = htonl(length);
+         c->out.append((Tnc8 *)&prefix, sizeof(prefix));
+         c->out.append((Tnc8 *)frame, length);
+         if(batch && c->out.size() < SOCKET_BATCH_BYTES)
+            return SUCCESS;
+         return flush(c);
+         }
+
+      /*!
+       * write, but with the frame in count pieces, which go to the kernel as
+       * they are rather than being copied together first. Pieces are only
+       * copied when batching, when earlier frames are still waiting to be
+       * sent, or for whatever part the kernel did not take at once.
+       */
+         Ts32
+      writev
+         (
+         TConnection *c,
+         const struct iovec *iov,
+         size_t count,
+         TBoolean batch
+         )
+         {
+         size_t length = 0;
+         size_t i;
+         for(i = 0; i < count; i++)
+            length += iov[i].iov_len;
+         uint32_t prefix = htonl(length);
+
+         if(batch || !c->out.empty() || count >= SOCKET_IOV_MAX)
+            {
+            c->out.append((Tnc8 *)&prefix, sizeof(prefix));
+            for(i = 0; i < count; i++)
+               c->out.append((Tnc8 *)iov[i].iov_base, iov[i].iov_len);
+            if(batch && c->out.size() < SOCKET_BATCH_BYTES)
+               return SUCCESS;
+            return flush(c);
+            }
+
+         struct iovec pieces[SOCKET_IOV_MAX];
+         pieces[0].iov_base = &prefix;
+         pieces[0].iov_len = sizeof(prefix);
+         for(i = 0; i < count; i++)
+            pieces[i + 1] = iov[i];
+         struct msghdr m;
+         memset(&m, 0, sizeof(m));
+         m.msg_iov = pieces;
+         m.msg_iovlen = count + 1;
+         ssize_t n;
+         while(-1 == (n = ::sendmsg(c->fd, &m, MSG_NOSIGNAL)) && errno == EINTR);
+         if(-1 == n)
+            {
+            MESSAGING_LOG_POSIX_ERROR;
+            return FAILURE;
+            }
+
+         // the rest of the frame goes the slow way
+         size_t sent = n;
+         for(i = 0; i < count + 1; i++)
+            {
+            if(sent >= pieces[i].iov_len)
+               sent -= pieces[i].iov_len;
+            else
+               {
+               c->out.append((Tnc8 *)pieces[i].iov_base + sent, pieces[i].iov_len - sent);
+               sent = 0;
+               }
+            }
+         return c->out.empty() ? SUCCESS : flush(c);
+         }
+
+      /*!
+       * Read whatever has arrived and hand each complete frame to handler.
+       * @return The number of frames handled, or -1 if the connection was
+       * closed or broken.
+       */
+         ssize_t
+      read
+         (
+         TConnection *c,
+         TFrameHandler handler,
+         TVoid *context
+         )
+         {
+         Tn8 buffer[SOCKET_READ_BYTES];
+         ssize_t n = ::recv(c->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+         if(0 == n)
+            return -1;
+         if(-1 == n)
+            {
+            if(errno == EAGAIN || errno == EINTR)
+               return 0;
+            MESSAGING_LOG_POSIX_ERROR;
+            return -1;
+            }
+         c->in.append(buffer, n);
+
+         ssize_t frames = 0;
+         size_t start = 0;
+         while(c->in.size() - start >= sizeof(Tu32))
+            {
+            uint32_t prefix;
+            memcpy(&prefix, c->in.data() + start, sizeof(prefix));
+            size_t length = ntohl(prefix);
+            if(length > SOCKET_FRAME_MAX)
+               {
+               MESSAGING_LOG_ERROR("Frame of %u bytes is too large, dropping connection", length);
+               return -1;
+               }
+            if(c->in.size() - start - sizeof(prefix) < length)
+               break;
+            handler(c->in.data() + start + sizeof(prefix), length, context);
+            start += sizeof(prefix) + length;
+            frames++;
+            }
+         c->in.erase(0, start);
+         return frames;
+         }
+      }
+   }
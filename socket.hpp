@@ -0,0 +1,44 @@
+/*
+ * socket.hpp
+ *
+ *  Created on: Oct 18, 2026
+ */
+
+#ifndef SOCKET_HPP_
+#define SOCKET_HPP_
+
+#include <string>
+#include <sys/uio.h>
+
+#include "include/aditypes.h"
+
+namespace msg
+   {
+   namespace sock
+      {
+      /*!
+       * A stream socket carrying length-prefixed frames, with what has been
+       * read but not yet handled and what has been written but not yet sent.
+       */
+      typedef struct
+         {
+         int fd;
+         std::string in;
+         std::string out;
+         } TConnection;
+
+      typedef TVoid (*TFrameHandler)(const TVoid *frame, size_t length, TVoid *context);
+
+      int open(Tnc8 *address, TBoolean listening);
+
+      Ts32 write(TConnection *, const TVoid *frame, size_t length, TBoolean batch);
+
+      Ts32 writev(TConnection *, const struct iovec *, size_t count, TBoolean batch);
+
+      Ts32 flush(TConnection *);
+
+      ssize_t read(TConnection *, TFrameHandler, TVoid *context);
+      }
+   }
+
+#endif /* SOCKET_HPP_ */
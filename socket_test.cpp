@@ -0,0 +1,253 @@
+/*
+ * socket_test.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *
+ * Sends messages over Unix-domain and TCP loopback sockets (see
+ * msg::addSocketRoute) to an agent in a child process, which hands on what
+ * it receives with msg::pollSockets and reports it back through a pipe.
+ * Checks plain sending, batching, a frame that arrives in two reads, and
+ * that sending carries on once the connection has broken.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <mqueue.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include "messaging.hpp"
+#include "socket.hpp"
+#include "check.hpp"
+
+#define FAR_PATH "/socket_test_far"
+#define NOTHING_MS 20
+#define ARRIVAL_MS 2000
+
+static msg::TAgentKey g_me;
+static msg::TResourceKey g_token;
+
+/*
+ * The far end: an agent of its own behind a socket at address, writing the
+ * token of every message it receives to fd.
+ */
+   static pid_t
+startFar
+   (
+   Tnc8 *address,
+   int fd
+   )
+   {
+   int ready[2];
+   if(0 != pipe(ready))
+      return -1;
+   pid_t pid = fork();
+   if(pid != 0)
+      {
+      close(ready[1]);
+      Tn8 c;
+      if(1 != read(ready[0], &c, 1))
+         pid = -1;
+      close(ready[0]);
+      return pid;
+      }
+
+   close(ready[0]);
+   msg::TAgentKey far = msg::createAgent(FAR_PATH, 8, 1024, FALSE);
+   if(far == (msg::TAgentKey)-1)
+      _exit(1);
+   if(SUCCESS != msg::listenSocket(address))
+      _exit(1);
+   write(ready[1], "r", 1);
+   for(;;)
+      {
+      msg::pollSockets(10);
+      msg::TMsg *in;
+      while((in = msg::receive(far)) != NULL)
+         {
+         Tu32 token = in->get<Tu32>(0);
+         write(fd, &token, sizeof(token));
+         }
+      msg::clearReceived(far);
+      }
+   }
+
+   static TVoid
+stopFar
+   (
+   pid_t pid
+   )
+   {
+   kill(pid, SIGKILL);
+   waitpid(pid, NULL, 0);
+   }
+
+/*
+ * The tokens that reach the far end within timeoutMs, up to count of them.
+ */
+   static std::vector<Tu32>
+collect
+   (
+   int fd,
+   size_t count,
+   Ts32 timeoutMs
+   )
+   {
+   std::vector<Tu32> tokens;
+   struct pollfd p = {fd, POLLIN, 0};
+   while(tokens.size() < count && poll(&p, 1, timeoutMs) > 0)
+      {
+      Tu32 token;
+      if(sizeof(token) != read(fd, &token, sizeof(token)))
+         break;
+      tokens.push_back(token);
+      }
+   return tokens;
+   }
+
+   static Ts32
+sendToken
+   (
+   Tu32 token
+   )
+   {
+   msg::TMsg out(REST_SET);
+   out.setSender(g_me);
+   out.setRecipient(msg::getAgentKey(FAR_PATH));
+   out.put<Tu32>(g_token, token);
+   return msg::send(&out);
+   }
+
+   static TBoolean
+arrived
+   (
+   const std::vector<Tu32> &tokens,
+   Tu32 first,
+   Tu32 last
+   )
+   {
+   if(tokens.size() != last - first + 1)
+      return FALSE;
+   for(size_t i = 0; i < tokens.size(); i++)
+      if(tokens[i] != first + i)
+         return FALSE;
+   return TRUE;
+   }
+
+/*
+ * Write a frame for token by hand, in two pieces a while apart.
+ */
+   static TVoid
+splitFrame
+   (
+   Tnc8 *address,
+   int fd,
+   Tu32 token
+   )
+   {
+   msg::TMsg out(REST_SET);
+   out.setSender(g_me);
+   out.setRecipient(msg::getAgentKey(FAR_PATH));
+   out.put<Tu32>(g_token, token);
+   std::string frame("/socket_test");
+   frame += '\0';
+   frame += FAR_PATH;
+   frame += '\0';
+   frame.append((Tnc8 *)&out, out.getBodySize() + sizeof(msg::TMsg) - MESSAGE_BODY_MEM_SIZE);
+   Tu32 prefix = htonl(frame.size());
+   frame.insert(0, (Tnc8 *)&prefix, sizeof(prefix));
+
+   int s = msg::sock::open(address, FALSE);
+   CHECK(s != -1, "%s: cannot connect", address);
+   if(s == -1)
+      return;
+   size_t half = frame.size() / 2;
+   send(s, frame.data(), half, MSG_NOSIGNAL);
+   CHECK(collect(fd, 1, NOTHING_MS).empty(), "%s: half a frame was handed on", address);
+   send(s, frame.data() + half, frame.size() - half, MSG_NOSIGNAL);
+   CHECK(arrived(collect(fd, 1, ARRIVAL_MS), token, token), "%s: a frame in two pieces did not arrive", address);
+   close(s);
+   }
+
+   static TVoid
+runOver
+   (
+   Tnc8 *address
+   )
+   {
+   int tokens[2];
+   if(0 != pipe(tokens))
+      return;
+   pid_t far = startFar(address, tokens[1]);
+   CHECK(far > 0, "%s: the far end did not start", address);
+   if(far <= 0)
+      return;
+   msg::addSocketRoute(FAR_PATH, address);
+
+   for(Tu32 t = 1; t <= 5; t++)
+      CHECK(SUCCESS == sendToken(t), "%s: cannot send %u", address, t);
+   CHECK(arrived(collect(tokens[0], 5, ARRIVAL_MS), 1, 5), "%s: sent one at a time, not all arrived in order", address);
+
+   // held back until flushed, here by the timer that runTimers sets off
+   msg::setSocketBatching(TRUE);
+   for(Tu32 t = 6; t <= 8; t++)
+      CHECK(SUCCESS == sendToken(t), "%s: cannot send %u", address, t);
+   CHECK(collect(tokens[0], 1, NOTHING_MS).empty(), "%s: a batch went before being flushed", address);
+   msg::runTimers();
+   CHECK(arrived(collect(tokens[0], 3, ARRIVAL_MS), 6, 8), "%s: a batch did not arrive in order", address);
+   msg::setSocketBatching(FALSE);
+
+   splitFrame(address, tokens[0], 9);
+
+   // the connection breaks with the far end; whatever is written before
+   // that shows may be lost, e.g. over TCP until the reset comes back
+   stopFar(far);
+   far = startFar(address, tokens[1]);
+   CHECK(far > 0, "%s: the far end did not start again", address);
+   sendToken(10);
+   CHECK(SUCCESS == sendToken(11), "%s: cannot send after reconnecting", address);
+   CHECK(SUCCESS == sendToken(12), "%s: cannot send after reconnecting", address);
+   std::vector<Tu32> after = collect(tokens[0], 3, ARRIVAL_MS);
+   if(!after.empty() && after[0] == 10)
+      after.erase(after.begin());
+   CHECK(arrived(after, 11, 12), "%s: sending did not carry on after the connection broke", address);
+
+   if(far > 0)
+      stopFar(far);
+   msg::removeRoute(FAR_PATH);
+   close(tokens[0]);
+   close(tokens[1]);
+   }
+
+   int
+main()
+   {
+   // one registry for both ends, since the far end has to know the path
+   // by the time this end looks it up, and removed afterwards
+   Tn8 registry[64];
+   snprintf(registry, sizeof(registry), "/socket_test-%d", (int)getpid());
+   setenv("DUMBWAITER_NAME_REGISTRY", registry, 1);
+   msg::initialize("names.conf");
+   g_me = msg::createAgent("/socket_test", 8, 1024, FALSE);
+   g_token = msg::createResource("socketToken", msg::UNSIGNED);
+
+   Tn8 address[64];
+   snprintf(address, sizeof(address), "unix:/tmp/socket_test-%d.sock", (int)getpid());
+   runOver(address);
+   unlink(address + 5);
+   snprintf(address, sizeof(address), "tcp:127.0.0.1:%d", 20000 + (int)getpid() % 20000);
+   runOver(address);
+
+   msg::destroyAgent("/socket_test");
+   mq_unlink(FAR_PATH);
+   shm_unlink(registry);
+   return checkResult("socket");
+   }
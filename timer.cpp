@@ -0,0 +1,202 @@
+/*!
+ * @namespace msg::timer
+ * Hierarchical timer wheel, for the timers behind msg::sendAt and friends.
+ *
+ * Time is counted in ticks. The first level has a slot for each of the next
+ * TIMER_SLOTS ticks, the second a slot for each of the next TIMER_SLOTS runs
+ * of TIMER_SLOTS ticks, and so on, so adding and removing a timer take
+ * constant time however many there are. A timer further off than the wheel
+ * reaches waits in the last level and is placed again when its slot comes
+ * round. Whenever a level has gone all the way round, the next slot of the
+ * level above is emptied into it.
+ */
+
+#include <cstring>
+
+#include "timer.hpp"
+
+#define TIMER_BITS 8
+
+namespace msg
+   {
+   namespace timer
+      {
+         TVoid
+      init
+         (
+         TWheel *w,
+         Ts64 now
+         )
+         {
+         memset(w, 0, sizeof(*w));
+         w->now = now;
+         }
+
+         static TVoid
+      place
+         (
+         TWheel *w,
+         TTimer *t
+         )
+         {
+         Ts64 due = t->due < w->now ? w->now : t->due;
+         Ts64 delta = due - w->now;
+         size_t level = 0;
+         while(level < TIMER_LEVELS - 1 && delta >= ((Ts64)1 << (TIMER_BITS * (level + 1))))
+            level++;
+         if(level == TIMER_LEVELS - 1 && delta >= ((Ts64)1 << (TIMER_BITS * TIMER_LEVELS)))
+            due = w->now + ((Ts64)1 << (TIMER_BITS * TIMER_LEVELS)) - 1;
+         TTimer **slot = &w->slots[level][(due >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)];
+         t->slot = slot;
+         t->prev = NULL;
+         t->next = *slot;
+         if(*slot)
+            (*slot)->prev = t;
+         *slot = t;
+         }
+
+      /*!
+       * Start t, which goes off at tick t->due.
+       */
+         TVoid
+      add
+         (
+         TWheel *w,
+         TTimer *t
+         )
+         {
+         place(w, t);
+         w->count++;
+         }
+
+         static TVoid
+      unlink
+         (
+         TTimer *t
+         )
+         {
+         if(t->prev)
+            t->prev->next = t->next;
+         else
+            *t->slot = t->next;
+         if(t->next)
+            t->next->prev = t->prev;
+         t->slot = NULL;
+         }
+
+      /*!
+       * Stop t before it goes off.
+       */
+         TVoid
+      remove
+         (
+         TWheel *w,
+         TTimer *t
+         )
+         {
+         if(t->slot)
+            {
+            unlink(t);
+            w->count--;
+            }
+         }
+
+         static TVoid
+      cascade
+         (
+         TWheel *w,
+         size_t level
+         )
+         {
+         TTimer **slot = &w->slots[level][(w->now >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)];
+         TTimer *t = *slot;
+         *slot = NULL;
+         while(t)
+            {
+            TTimer *next = t->next;
+            place(w, t);
+            t = next;
+            }
+         }
+
+      /*!
+       * Move on to tick now.
+       * @return The timers that have gone off, linked through next, in no
+       * particular order. They are no longer in the wheel.
+       */
+         TTimer *
+      expire
+         (
+         TWheel *w,
+         Ts64 now
+         )
+         {
+         TTimer *expired = NULL;
+         while(w->now <= now)
+            {
+            // skip the ticks at which nothing goes off or moves down
+            Ts64 next = nextDue(w);
+            if(next == -1 || next > now)
+               {
+               w->now = now + 1;
+               break;
+               }
+            if(next > w->now)
+               w->now = next;
+            for(size_t level = 1; level < TIMER_LEVELS; level++)
+               {
+               if(w->now & ((1 << (TIMER_BITS * level)) - 1))
+                  break;
+               cascade(w, level);
+               }
+            TTimer **slot = &w->slots[0][w->now & (TIMER_SLOTS - 1)];
+            while(*slot)
+               {
+               TTimer *t = *slot;
+               unlink(t);
+               w->count--;
+               t->next = expired;
+               expired = t;
+               }
+            w->now++;
+            }
+         return expired;
+         }
+
+      /*!
+       * The earliest tick at which a timer may go off, or -1 if there are
+       * none. It may be early, when a timer is still in an upper level,
+       * since timers are only placed exactly on the way down.
+       */
+         Ts64
+      nextDue
+         (
+         const TWheel *w
+         )
+         {
+         if(w->count == 0)
+            return -1;
+         Ts64 earliest = -1;
+         for(size_t level = 0; level < TIMER_LEVELS; level++)
+            {
+            size_t shift = TIMER_BITS * level;
+            Ts64 position = w->now >> shift;
+            // the current slot of an upper level has already been emptied,
+            // unless we are at its very start, so anything in it is a whole
+            // round away
+            size_t first = level && (w->now & (((Ts64)1 << shift) - 1)) ? 1 : 0;
+            for(size_t j = first; j <= TIMER_SLOTS; j++)
+               {
+               if(w->slots[level][(position + j) & (TIMER_SLOTS - 1)])
+                  {
+                  Ts64 start = level ? (position + j) << shift : position + j;
+                  if(earliest == -1 || start < earliest)
+                     earliest = start;
+                  break;
+                  }
+               }
+            }
+         return earliest;
+         }
+      }
+   }
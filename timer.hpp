@@ -0,0 +1,49 @@
+/*
+ * timer.hpp
+ *
+ *  Created on: Oct 19, 2026
+ */
+
+#ifndef TIMER_HPP_
+#define TIMER_HPP_
+
+#include "include/aditypes.h"
+
+#define TIMER_LEVELS 4
+#define TIMER_SLOTS 256
+
+namespace msg
+   {
+   namespace timer
+      {
+      /*!
+       * To be embedded in whatever is being timed.
+       */
+      typedef struct TTimer
+         {
+         struct TTimer *next;
+         struct TTimer *prev;
+         struct TTimer **slot;
+         Ts64 due; // in ticks
+         } TTimer;
+
+      typedef struct
+         {
+         Ts64 now; // the next tick to expire
+         size_t count;
+         TTimer *slots[TIMER_LEVELS][TIMER_SLOTS];
+         } TWheel;
+
+      TVoid init(TWheel *, Ts64 now);
+
+      TVoid add(TWheel *, TTimer *);
+
+      TVoid remove(TWheel *, TTimer *);
+
+      TTimer *expire(TWheel *, Ts64 now);
+
+      Ts64 nextDue(const TWheel *);
+      }
+   }
+
+#endif /* TIMER_HPP_ */
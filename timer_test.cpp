@@ -0,0 +1,146 @@
+/*
+ * timer_test.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *
+ * Checks that msg::timer goes off at exactly the tick each timer is due,
+ * above all for timers that start out in an upper level and have to move
+ * down, and that nextDue is never later than the earliest timer.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "timer.hpp"
+#include "check.hpp"
+
+using namespace msg;
+
+   static Ts64
+earliestPending
+   (
+   const std::vector<timer::TTimer> &timers,
+   const std::vector<bool> &pending
+   )
+   {
+   Ts64 earliest = -1;
+   for(size_t i = 0; i < timers.size(); i++)
+      if(pending[i] && (earliest == -1 || timers[i].due < earliest))
+         earliest = timers[i].due;
+   return earliest;
+   }
+
+/*
+ * Jump from one nextDue to the next, as runTimers does, and check that each
+ * timer goes off at its own tick and no other.
+ */
+   static TVoid
+jumpThrough
+   (
+   Ts64 start
+   )
+   {
+   static const Ts64 deltas[] =
+      {
+      0, 1, 254, 255, 256, 257, 511, 512,
+      65535, 65536, 65537, 65792, 131071,
+      (1 << 24) - 1, 1 << 24, (1 << 24) + 1, (1 << 24) + 65536,
+      ((Ts64)1 << 32) - 1, (Ts64)1 << 32, ((Ts64)1 << 32) + 5, ((Ts64)3 << 32) + 300
+      };
+   size_t count = sizeof(deltas) / sizeof(deltas[0]);
+
+   timer::TWheel wheel;
+   timer::init(&wheel, start);
+   std::vector<timer::TTimer> timers(count);
+   std::vector<bool> pending(count, true);
+   for(size_t i = 0; i < count; i++)
+      {
+      timers[i].due = start + deltas[i];
+      timer::add(&wheel, &timers[i]);
+      }
+
+   size_t fired = 0;
+   for(size_t steps = 0; steps < 100000; steps++)
+      {
+      Ts64 next = timer::nextDue(&wheel);
+      Ts64 earliest = earliestPending(timers, pending);
+      if(next == -1)
+         {
+         CHECK(earliest == -1, "start %lld: nextDue is -1 with a timer due at %lld", (long long)start, (long long)earliest);
+         break;
+         }
+      CHECK(next <= earliest, "start %lld: nextDue %lld is after the earliest timer, %lld", (long long)start, (long long)next, (long long)earliest);
+      for(timer::TTimer *t = timer::expire(&wheel, next); t; t = t->next)
+         {
+         size_t i = t - &timers[0];
+         CHECK(pending[i], "start %lld: timer %u went off twice", (long long)start, (unsigned)i);
+         CHECK(t->due == next, "start %lld: timer due at %lld went off at %lld", (long long)start, (long long)t->due, (long long)next);
+         pending[i] = false;
+         fired++;
+         }
+      }
+   CHECK(fired == count, "start %lld: %u of %u timers went off", (long long)start, (unsigned)fired, (unsigned)count);
+   CHECK(wheel.count == 0, "start %lld: %u timers left in the wheel", (long long)start, (unsigned)wheel.count);
+   }
+
+/*
+ * Expire one tick at a time over more than one round of the second level,
+ * with some timers removed and some added late, already due.
+ */
+   static TVoid
+stepThrough()
+   {
+   const size_t count = 2000;
+   const Ts64 start = 1000;
+   const Ts64 span = 70000;
+
+   timer::TWheel wheel;
+   timer::init(&wheel, start);
+   std::vector<timer::TTimer> timers(count + 1);
+   std::vector<bool> pending(count + 1, false);
+   srand(1);
+   for(size_t i = 0; i < count; i++)
+      {
+      timers[i].due = start + rand() % span;
+      timer::add(&wheel, &timers[i]);
+      pending[i] = true;
+      }
+   for(size_t i = 0; i < count; i += 3)
+      {
+      timer::remove(&wheel, &timers[i]);
+      pending[i] = false;
+      }
+   CHECK(wheel.count == count - (count + 2) / 3, "%u timers in the wheel after removing", (unsigned)wheel.count);
+
+   for(Ts64 now = start; now < start + span; now++)
+      {
+      if(now == start + 300)
+         {
+         // one already due when added goes off at the next expire
+         timers[count].due = start;
+         timer::add(&wheel, &timers[count]);
+         pending[count] = true;
+         }
+      for(timer::TTimer *t = timer::expire(&wheel, now); t; t = t->next)
+         {
+         size_t i = t - &timers[0];
+         CHECK(pending[i], "timer %u went off at %lld but was not pending", (unsigned)i, (long long)now);
+         CHECK(i == count ? now == start + 300 : t->due == now, "timer due at %lld went off at %lld", (long long)t->due, (long long)now);
+         pending[i] = false;
+         }
+      }
+   CHECK(earliestPending(timers, pending) == -1, "a timer never went off");
+   CHECK(timer::nextDue(&wheel) == -1, "nextDue is not -1 for an empty wheel");
+   }
+
+   int
+main()
+   {
+   static const Ts64 starts[] = {0, 1, 255, 256, 65535, 65536, 12345678, ((Ts64)1 << 32) - 3};
+   for(size_t i = 0; i < sizeof(starts) / sizeof(starts[0]); i++)
+      jumpThrough(starts[i]);
+   stepThrough();
+
+   return checkResult("timer");
+   }
@@ -0,0 +1,79 @@
+/*
+ * wait_test.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *
+ * Checks that timers go off on time while an agent waits in waitReceive,
+ * whichever phase of its wait strategy it is in, e.g. that a message sent
+ * with sendAfter to the waiting agent itself arrives.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <time.h>
+#include <unistd.h>
+
+#include "messaging.hpp"
+#include "check.hpp"
+
+#define WAIT_DELAY_US 20000
+#define WAIT_SLACK_US 100000
+
+   static Ts64
+nowUs()
+   {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (Ts64)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+   }
+
+/*
+ * Have a message sent to me after WAIT_DELAY_US and wait for it, spinning
+ * for spinUs and yielding for yieldUs first.
+ */
+   static TVoid
+waitForLater
+   (
+   msg::TAgentKey me,
+   msg::TResourceKey rk,
+   size_t spinUs,
+   size_t yieldUs
+   )
+   {
+   msg::setWaitStrategy(me, spinUs, yieldUs, FALSE);
+   Tu32 token = (Tu32)(spinUs + yieldUs);
+   msg::TMsg later(REST_SET);
+   later.setSender(me);
+   later.setRecipient(me);
+   later.put<Tu32>(rk, token);
+   msg::sendAfter(&later, WAIT_DELAY_US);
+
+   Ts64 start = nowUs();
+   msg::TMsg *in = msg::waitReceive(me);
+   Ts64 took = nowUs() - start;
+   CHECK(in != NULL, "spin %u, yield %u: nothing received", (unsigned)spinUs, (unsigned)yieldUs);
+   if(in)
+      CHECK(in->get<Tu32>(0) == token, "spin %u, yield %u: received the wrong message", (unsigned)spinUs, (unsigned)yieldUs);
+   CHECK(took < WAIT_DELAY_US + WAIT_SLACK_US, "spin %u, yield %u: took %ld us for a timer due in %u us", (unsigned)spinUs, (unsigned)yieldUs, (long)took, (unsigned)WAIT_DELAY_US);
+   }
+
+   int
+main()
+   {
+   // a timer that never goes off would leave waitReceive blocked for good
+   alarm(10);
+
+   setenv("DUMBWAITER_NAME_REGISTRY", "", 1);
+   msg::initialize("names.conf");
+   msg::TAgentKey me = msg::createAgent("/wait_test", 4, 256);
+   msg::TResourceKey rk = msg::createResource("waitToken", msg::UNSIGNED);
+
+   waitForLater(me, rk, 0, 0);                     // blocks at once
+   waitForLater(me, rk, 4 * WAIT_DELAY_US, 0);     // due while spinning
+   waitForLater(me, rk, 0, 4 * WAIT_DELAY_US);     // due while yielding
+   waitForLater(me, rk, WAIT_DELAY_US / 4, WAIT_DELAY_US / 4); // due after both
+
+   msg::destroyAgent("/wait_test");
+   return checkResult("wait");
+   }